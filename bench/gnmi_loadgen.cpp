@@ -0,0 +1,309 @@
+/*  vim:set softtabstop=2 shiftwidth=2 tabstop=2 expandtab: */
+
+/*
+ * gNMI Subscribe load generator.
+ * Runs N concurrent subscribers against a server and prints one JSON object
+ * with throughput, sample-to-wire latency and server CPU usage.
+ * Sample-to-wire latency is the time between the Notification timestamp,
+ * i.e. when counters were read, and its reception. Client and server must
+ * share the same clock, e.g. run on the same host over loopback.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <algorithm>
+#include <getopt.h>
+#include <unistd.h>
+
+#include <grpcpp/grpcpp.h>
+
+#include "../proto/gnmi.grpc.pb.h"
+
+using namespace grpc;
+using namespace gnmi;
+using namespace std;
+using namespace chrono;
+
+/* Options of the run */
+struct LoadConfig {
+  string address = "localhost:50051";
+  unsigned clients = 10;
+  SubscriptionList_Mode mode = SubscriptionList_Mode_STREAM;
+  vector<string> paths; // PATH[@ms]
+  unsigned duration = 10; // seconds
+  unsigned pollInterval = 1000; // ms
+  int serverPid = 0;
+};
+
+/* Counters of one or all subscribers */
+struct LoadStats {
+  uint64_t notifications = 0;
+  uint64_t updates = 0;
+  uint64_t bytes = 0;
+  uint64_t errors = 0;
+  vector<int64_t> latencies; // ns
+
+  void Merge(const LoadStats& other)
+  {
+    notifications += other.notifications;
+    updates += other.updates;
+    bytes += other.bytes;
+    errors += other.errors;
+    latencies.insert(latencies.end(), other.latencies.begin(),
+                     other.latencies.end());
+  }
+};
+
+/* BuildRequest - SubscriptionList of the run, paths as /a/b[k=v]/c[@ms] */
+static SubscribeRequest BuildRequest(const LoadConfig& config)
+{
+  SubscribeRequest request;
+  SubscriptionList *list = request.mutable_subscribe();
+
+  list->set_mode(config.mode);
+  for (auto spec : config.paths) {
+    Subscription *sub = list->add_subscription();
+    uint64_t interval = 1000;
+    size_t at = spec.find('@');
+    if (at != string::npos) {
+      interval = stoull(spec.substr(at + 1));
+      spec = spec.substr(0, at);
+    }
+    sub->set_mode(SAMPLE);
+    sub->set_sample_interval(interval * 1000000);
+
+    stringstream ss(spec);
+    string name;
+    while (getline(ss, name, '/')) {
+      if (name.empty())
+        continue;
+      PathElem *elem = sub->mutable_path()->add_elem();
+      size_t bracket = name.find('[');
+      if (bracket != string::npos && name.back() == ']') {
+        string kv = name.substr(bracket + 1, name.size() - bracket - 2);
+        size_t eq = kv.find('=');
+        (*elem->mutable_key())[kv.substr(0, eq)] =
+          eq == string::npos ? "" : kv.substr(eq + 1);
+        name = name.substr(0, bracket);
+      }
+      elem->set_name(name);
+    }
+  }
+
+  return request;
+}
+
+/* Record - Account a received response */
+static void Record(const SubscribeResponse& response, LoadStats& stats)
+{
+  if (!response.has_update())
+    return;
+
+  int64_t now = duration_cast<nanoseconds>(
+      system_clock::now().time_since_epoch()).count();
+  stats.notifications++;
+  stats.updates += response.update().update_size();
+  stats.bytes += response.ByteSizeLong();
+  stats.latencies.push_back(now - response.update().timestamp());
+}
+
+/* RunClient - One subscriber until deadline */
+static void RunClient(const LoadConfig& config, unsigned id,
+                      system_clock::time_point deadline, LoadStats& stats)
+{
+  ChannelArguments args;
+  args.SetMaxReceiveMessageSize(-1);
+  args.SetInt("gnmi_loadgen_client", id); // one connection per client
+  shared_ptr<Channel> channel = CreateCustomChannel(config.address,
+      InsecureChannelCredentials(), args);
+  unique_ptr<gNMI::Stub> stub = gNMI::NewStub(channel);
+  SubscribeRequest request = BuildRequest(config);
+  SubscribeResponse response;
+
+  do {
+    ClientContext context;
+    context.set_deadline(deadline);
+    auto stream = stub->Subscribe(&context);
+    if (!stream->Write(request)) {
+      stats.errors++;
+      break;
+    }
+
+    if (config.mode == SubscriptionList_Mode_POLL) {
+      SubscribeRequest poll;
+      poll.mutable_poll();
+      while (system_clock::now() < deadline) {
+        auto next = system_clock::now() + milliseconds(config.pollInterval);
+        if (!stream->Write(poll) || !stream->Read(&response))
+          break;
+        Record(response, stats);
+        this_thread::sleep_until(min(next, deadline));
+      }
+      context.TryCancel();
+    } else {
+      while (stream->Read(&response))
+        Record(response, stats);
+    }
+
+    Status status = stream->Finish();
+    if (!status.ok() && status.error_code() != StatusCode::DEADLINE_EXCEEDED &&
+        status.error_code() != StatusCode::CANCELLED)
+      stats.errors++;
+  } while (config.mode == SubscriptionList_Mode_ONCE &&
+           system_clock::now() < deadline);
+}
+
+/* CpuTime - User and system CPU time of a process in seconds, -1 if unknown */
+static double CpuTime(int pid)
+{
+  ifstream in("/proc/" + to_string(pid) + "/stat");
+  string line;
+
+  if (!pid || !getline(in, line))
+    return -1;
+
+  // Fields after the command name, which may contain spaces
+  stringstream ss(line.substr(line.rfind(')') + 2));
+  vector<string> fields;
+  string field;
+  while (ss >> field)
+    fields.push_back(field);
+  if (fields.size() < 13)
+    return -1;
+
+  return (stod(fields[11]) + stod(fields[12])) / sysconf(_SC_CLK_TCK);
+}
+
+/* Percentile - Latency quantile in microseconds of sorted ns latencies */
+static double Percentile(const vector<int64_t>& sorted, double q)
+{
+  if (sorted.empty())
+    return 0;
+
+  size_t i = min(sorted.size() - 1, (size_t)(q * sorted.size()));
+  return sorted[i] / 1000.0;
+}
+
+static void show_usage(std::string name)
+{
+  std::cerr << "Usage: " << name << " <option(s)>\n"
+    << "Options:\n"
+    << "\t-h,--help\t\t\tShow this help message\n"
+    << "\t-a,--address HOST:PORT\t\tServer address (default localhost:50051)\n"
+    << "\t-n,--clients N\t\t\tNumber of concurrent subscribers (default 10)\n"
+    << "\t-m,--mode MODE\t\t\tstream, poll or once (default stream)\n"
+    << "\t-p,--path PATH[@MS]\t\tSubscribed path and sample interval, "
+    << "repeatable (default /if/rx@1000)\n"
+    << "\t-d,--duration SECONDS\t\tLength of the run (default 10)\n"
+    << "\t-i,--poll-interval MS\t\tDelay between Poll requests "
+    << "(default 1000)\n"
+    << "\t-s,--server-pid PID\t\tReport CPU usage of this server process\n"
+    << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  int c;
+  int option_index = 0;
+  LoadConfig config;
+
+  static struct option long_options[] =
+  {
+    {"help", no_argument, 0, 'h'},
+    {"address", required_argument, 0, 'a'},
+    {"clients", required_argument, 0, 'n'},
+    {"mode", required_argument, 0, 'm'},
+    {"path", required_argument, 0, 'p'},
+    {"duration", required_argument, 0, 'd'},
+    {"poll-interval", required_argument, 0, 'i'},
+    {"server-pid", required_argument, 0, 's'},
+    {0, 0, 0, 0}
+  };
+
+  while ((c = getopt_long(argc, argv, "ha:n:m:p:d:i:s:", long_options,
+                          &option_index)) != -1) {
+    switch (c)
+    {
+      case 'a':
+        config.address = optarg;
+        break;
+      case 'n':
+        config.clients = max(1, atoi(optarg));
+        break;
+      case 'm':
+        if (string(optarg) == "stream")
+          config.mode = SubscriptionList_Mode_STREAM;
+        else if (string(optarg) == "poll")
+          config.mode = SubscriptionList_Mode_POLL;
+        else if (string(optarg) == "once")
+          config.mode = SubscriptionList_Mode_ONCE;
+        else {
+          show_usage(argv[0]);
+          exit(1);
+        }
+        break;
+      case 'p':
+        config.paths.push_back(optarg);
+        break;
+      case 'd':
+        config.duration = max(1, atoi(optarg));
+        break;
+      case 'i':
+        config.pollInterval = max(1, atoi(optarg));
+        break;
+      case 's':
+        config.serverPid = atoi(optarg);
+        break;
+      case 'h':
+        show_usage(argv[0]);
+        exit(0);
+      default:
+        show_usage(argv[0]);
+        exit(1);
+    }
+  }
+  if (config.paths.empty())
+    config.paths.push_back("/if/rx@1000");
+
+  vector<LoadStats> stats(config.clients);
+  vector<thread> clients;
+  auto start = steady_clock::now();
+  auto deadline = system_clock::now() + seconds(config.duration);
+  double cpuStart = CpuTime(config.serverPid);
+
+  for (unsigned i = 0; i < config.clients; i++)
+    clients.emplace_back(RunClient, cref(config), i, deadline, ref(stats[i]));
+  for (auto& client : clients)
+    client.join();
+
+  double cpuEnd = CpuTime(config.serverPid);
+  double elapsed = duration<double>(steady_clock::now() - start).count();
+  LoadStats total;
+  for (auto& s : stats)
+    total.Merge(s);
+  sort(total.latencies.begin(), total.latencies.end());
+
+  const char *modes[] = {"stream", "once", "poll"};
+  cout << "{\"benchmark\": \"subscribe_load\", "
+    << "\"mode\": \"" << modes[config.mode] << "\", "
+    << "\"clients\": " << config.clients << ", "
+    << "\"paths\": " << config.paths.size() << ", "
+    << "\"duration_s\": " << elapsed << ", "
+    << "\"notifications\": " << total.notifications << ", "
+    << "\"notifications_per_s\": " << total.notifications / elapsed << ", "
+    << "\"updates_per_s\": " << total.updates / elapsed << ", "
+    << "\"bytes_per_s\": " << total.bytes / elapsed << ", "
+    << "\"latency_p50_us\": " << Percentile(total.latencies, 0.5) << ", "
+    << "\"latency_p99_us\": " << Percentile(total.latencies, 0.99) << ", "
+    << "\"latency_p999_us\": " << Percentile(total.latencies, 0.999) << ", "
+    << "\"server_cpu\": "
+    << (cpuStart < 0 || cpuEnd < 0 ? -1 : (cpuEnd - cpuStart) / elapsed) << ", "
+    << "\"errors\": " << total.errors << "}" << endl;
+
+  return 0;
+}
@@ -0,0 +1,160 @@
+/*  vim:set softtabstop=2 shiftwidth=2 tabstop=2 expandtab: */
+
+/*
+ * Microbenchmarks of the Subscribe hot path, run on a synthetic counter
+ * source, or on VPP stat segment to compare reads by stat_segment_dump with
+ * reads in place. Prints one JSON object per benchmark.
+ * Usage: gnmi_microbench [SYNTHETIC_SPEC], see gnmi_server --synthetic.
+ *        gnmi_microbench vpp [PATH], PATH defaulting to /if.
+ */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+
+#include "../src/gnmi_synthetic.h"
+#include "../src/gnmi_handle_request.h"
+
+using namespace std;
+using namespace chrono;
+
+/* Number of timed batches per benchmark, and minimal length of a batch */
+static const int BATCHES = 50;
+static const nanoseconds MIN_BATCH = milliseconds(20);
+
+/* Run - Time op and print ns per operation, percentiles are over batches.
+ * @param name benchmark name.
+ * @param op operation to time.
+ * @param items items processed per operation, e.g. counters read.
+ */
+static void Run(const string& name, function<void()> op, size_t items = 1)
+{
+  // Warm up and find how many operations fill a batch
+  uint64_t n = 1;
+  for (;;) {
+    auto start = steady_clock::now();
+    for (uint64_t i = 0; i < n; i++)
+      op();
+    if (steady_clock::now() - start >= MIN_BATCH)
+      break;
+    n *= 2;
+  }
+
+  vector<double> perOp;
+  for (int b = 0; b < BATCHES; b++) {
+    auto start = steady_clock::now();
+    for (uint64_t i = 0; i < n; i++)
+      op();
+    perOp.push_back(duration<double, nano>(steady_clock::now() - start).count()
+                    / n);
+  }
+  sort(perOp.begin(), perOp.end());
+
+  cout << "{\"benchmark\": \"" << name << "\", "
+    << "\"ops_per_batch\": " << n << ", "
+    << "\"items_per_op\": " << items << ", "
+    << "\"ns_per_op_p50\": " << perOp[BATCHES / 2] << ", "
+    << "\"ns_per_op_p99\": " << perOp[BATCHES * 99 / 100] << ", "
+    << "\"ns_per_item_p50\": " << perOp[BATCHES / 2] / items << "}" << endl;
+}
+
+/* VppRun - Time reads of path from VPP stat segment, copied by
+ * stat_segment_dump then read in place.
+ * @param path UNIX path of counters to read.
+ */
+static void VppRun(const string& path)
+{
+  vector<string> patterns;
+  PathMatcher(path).Patterns(false, patterns);
+
+  for (int inPlace = 0; inPlace < 2; inPlace++) {
+    VppCounterSource source(inPlace);
+    StatConnector statc(source);
+    string mode = inPlace ? "_inplace" : "_dump";
+    RepeatedPtrField<Update> probe;
+    statc.FillCounters(&probe, path);
+
+    Run("VppRead" + mode, [&]() {
+      vector<CounterEntry> entries;
+      source.Read(patterns, entries);
+    }, probe.size());
+
+    Run("VppFillCounters" + mode, [&]() {
+      RepeatedPtrField<Update> updates;
+      vector<uint64_t> keys, values;
+      statc.FillCounters(&updates, path, &keys, &values);
+    }, probe.size());
+  }
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 1 && string(argv[1]) == "vpp") {
+    VppRun(argc > 2 ? argv[2] : "/if");
+    return 0;
+  }
+
+  SyntheticConfig config;
+  config.interfaces = 1000;
+  config.workers = 4;
+  if (argc > 1 && !config.Parse(argv[1])) {
+    cerr << "Invalid synthetic spec " << argv[1] << endl;
+    return 1;
+  }
+
+  SyntheticCounterSource source(config);
+  StatConnector statc(source);
+  SamplingEngine engine(statc);
+  const string unixPath = "/if/rx/GigabitEthernet0_8_0/T0/packets";
+
+  Run("split", [&]() {
+    vector<string> tokens = split(unixPath, '/');
+  });
+
+  Run("UnixToGnmiPath", [&]() {
+    Path path;
+    UnixToGnmiPath(unixPath, &path);
+  });
+
+  for (int aggregate = 0; aggregate < 2; aggregate++) {
+    RepeatedPtrField<Update> probe;
+    statc.FillCounters(&probe, "/if/rx", NULL, NULL, aggregate);
+    Run(aggregate ? "FillCounters_aggregate" : "FillCounters", [&]() {
+      RepeatedPtrField<Update> updates;
+      vector<uint64_t> keys, values;
+      statc.FillCounters(&updates, "/if/rx", &keys, &values, aggregate);
+    }, probe.size());
+  }
+
+  // Encoded Samples are cached, so this times the per stream share
+  SubscriptionList request;
+  request.mutable_prefix()->set_target("bench");
+  request.set_encoding(PROTO);
+  vector<SamplePtr> samples = {engine.Collect(SampleKey("/if/rx", false))};
+  auto discard = [](ByteBuffer& buffer) {};
+  Run("BuildNotification", [&]() {
+    RequestHandler::BuildNotification(request, samples, discard);
+  }, samples[0]->updates.size());
+
+  Run("Collect_BuildNotification", [&]() {
+    vector<SamplePtr> fresh = {engine.Collect(SampleKey("/if/rx", false))};
+    RequestHandler::BuildNotification(request, fresh, discard);
+  }, samples[0]->updates.size());
+
+  // Read and serialization of a fresh Sample in other forms
+  for (Encoding encoding : {JSON_IETF, PROTO}) {
+    for (int bulk = encoding == PROTO; bulk < 2; bulk++) {
+      string name = string("Collect_Serialize_") + Encoding_Name(encoding) +
+        (bulk ? "_bulk" : "");
+      Run(name, [&]() {
+        SamplePtr fresh = engine.Collect(SampleKey("/if/rx", false));
+        for (size_t c = 0; c < fresh->Chunks(encoding, bulk); c++)
+          fresh->Serialized(c, encoding, bulk);
+      }, samples[0]->updates.size());
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,319 @@
+/*  vim:set softtabstop=2 shiftwidth=2 tabstop=2 expandtab: */
+
+#include <fstream>
+#include <algorithm>
+#include <iostream>
+
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#include <grpc/grpc_security_constants.h>
+
+#include "gnmi_auth.h"
+
+using std::string;
+using std::chrono::steady_clock;
+using std::chrono::seconds;
+using std::chrono::duration;
+
+/* Rounds of PBKDF2 for users given on the command line */
+#define HASH_ROUNDS 100000
+#define HASH_SIZE 32
+#define SALT_SIZE 16
+/* Wrong passwords hashed per second, and at once after a quiet period */
+#define FAILURE_RATE 2
+#define FAILURE_BURST 10
+/* Peers whose state is kept */
+#define MAX_PEERS 1024
+
+/* RandomBytes - Draw size random bytes */
+static string RandomBytes(size_t size)
+{
+  string bytes(size, 0);
+
+  RAND_bytes(reinterpret_cast<unsigned char *>(&bytes[0]), size);
+
+  return bytes;
+}
+
+UserPassProcessor::UserPassProcessor()
+  : digestKey(RandomBytes(HASH_SIZE)), dummySalt(RandomBytes(SALT_SIZE)),
+    dummyRounds(0)
+{
+}
+
+/* Hash - PBKDF2-HMAC-SHA256 of a password
+ * @param password the password
+ * @param len length of password
+ * @param salt the salt
+ * @param rounds number of iterations
+ * @return HASH_SIZE bytes
+ */
+static string Hash(const char *password, size_t len, const string& salt,
+                   unsigned int rounds)
+{
+  string hash(HASH_SIZE, 0);
+
+  PKCS5_PBKDF2_HMAC(password, len,
+                    reinterpret_cast<const unsigned char *>(salt.data()),
+                    salt.size(), rounds, EVP_sha256(), HASH_SIZE,
+                    reinterpret_cast<unsigned char *>(&hash[0]));
+
+  return hash;
+}
+
+/* FromHex - Decode an hexadecimal string
+ * @param hex the string
+ * @param bytes filled with the decoded bytes
+ * @return false if hex is not made of pairs of hexadecimal digits
+ */
+static bool FromHex(const string& hex, string& bytes)
+{
+  static const string digits = "0123456789abcdef";
+
+  if (hex.size() % 2)
+    return false;
+  bytes.clear();
+  for (size_t i = 0; i < hex.size(); i += 2) {
+    size_t high = digits.find(tolower(hex[i]));
+    size_t low = digits.find(tolower(hex[i + 1]));
+    if (high == string::npos || low == string::npos)
+      return false;
+    bytes.push_back(high << 4 | low);
+  }
+
+  return true;
+}
+
+/* LoadUsers - Add users of a file, one per line as USER:ROUNDS:SALT:HASH,
+ * SALT and HASH being hexadecimal and HASH the PBKDF2-HMAC-SHA256 of the
+ * password. Empty lines and lines starting with # are skipped.
+ * @param path the file
+ * @return false if the file can not be read or has an invalid line
+ */
+bool UserPassProcessor::LoadUsers(const string& path)
+{
+  std::ifstream ifs(path);
+  string line;
+  int nb = 0;
+
+  if (!ifs) {
+    std::cerr << "File " << path << " not found" << std::endl;
+    return false;
+  }
+
+  while (std::getline(ifs, line)) {
+    nb++;
+    if (line.empty() || line[0] == '#')
+      continue;
+
+    User user;
+    size_t first = line.find(':');
+    size_t second = line.find(':', first + 1);
+    size_t third = line.find(':', second + 1);
+    if (first == 0 || first == string::npos || second == string::npos ||
+        third == string::npos || line.find(':', third + 1) != string::npos ||
+        !FromHex(line.substr(second + 1, third - second - 1), user.salt) ||
+        !FromHex(line.substr(third + 1), user.hash) ||
+        user.hash.size() != HASH_SIZE ||
+        atoi(line.substr(first + 1).c_str()) <= 0) {
+      std::cerr << path << ":" << nb << ": expected USER:ROUNDS:SALT:HASH"
+        << std::endl;
+      return false;
+    }
+    user.name = line.substr(0, first);
+    user.rounds = atoi(line.substr(first + 1).c_str());
+    dummyRounds = std::max(dummyRounds, user.rounds);
+    users.push_back(user);
+  }
+
+  return true;
+}
+
+/* AddUser - Add a user, hashing its password with a random salt
+ * @param name the user name
+ * @param password its password
+ */
+void UserPassProcessor::AddUser(const string& name, const string& password)
+{
+  User user;
+
+  user.name = name;
+  user.rounds = HASH_ROUNDS;
+  user.salt = RandomBytes(SALT_SIZE);
+  user.hash = Hash(password.data(), password.size(), user.salt, user.rounds);
+  dummyRounds = std::max(dummyRounds, user.rounds);
+  users.push_back(user);
+}
+
+/* Find - Find a user, without copying its name
+ * @param name the name
+ * @return the user or NULL if unknown
+ */
+UserPassProcessor::User *UserPassProcessor::Find(grpc::string_ref name)
+{
+  for (auto& user : users) {
+    if (user.name.size() == name.size() &&
+        user.name.compare(0, string::npos, name.data(), name.size()) == 0)
+      return &user;
+  }
+
+  return NULL;
+}
+
+/* FindPeer - Find the state of a peer, creating it with a full bucket,
+ * mtx held. Beyond MAX_PEERS, the least recently seen peer is forgotten.
+ * @param key the digest of the peer certificate
+ * @return the peer, valid until mtx is released
+ */
+UserPassProcessor::Peer& UserPassProcessor::FindPeer(const string& key)
+{
+  steady_clock::time_point now = steady_clock::now();
+  auto it = peers.find(key);
+
+  if (it == peers.end()) {
+    if (peers.size() >= MAX_PEERS) {
+      auto oldest = std::min_element(peers.begin(), peers.end(),
+          [](const std::pair<const string, Peer>& a,
+             const std::pair<const string, Peer>& b) {
+            return a.second.seenAt < b.second.seenAt;
+          });
+      peers.erase(oldest);
+    }
+    it = peers.emplace(key, Peer()).first;
+    it->second.tokens = FAILURE_BURST;
+    it->second.refillAt = now;
+  }
+  it->second.seenAt = now;
+
+  return it->second;
+}
+
+/* PeerKey - Identify the peer of an RPC by the SHA-256 of its client
+ * certificate, required and verified by the TLS handshake
+ * @param context the AuthContext of the RPC
+ * @return the digest, empty if the peer has no certificate
+ */
+static string PeerKey(const grpc::AuthContext *context)
+{
+  auto certs = context->FindPropertyValues(GRPC_X509_PEM_CERT_PROPERTY_NAME);
+  if (certs.empty())
+    return string();
+
+  string key(SHA256_DIGEST_LENGTH, 0);
+  SHA256(reinterpret_cast<const unsigned char *>(certs[0].data()),
+         certs[0].size(), reinterpret_cast<unsigned char *>(&key[0]));
+
+  return key;
+}
+
+/* Verify - Check the password of a user in a time independent of how much
+ * of it matches. A digest of the password is compared to the one of the
+ * last password verified for this user from this peer, hashing the password
+ * only when they differ. Unknown users are hashed too, so that they are not
+ * told apart by time. Each hash spends a token of the peer, given back if
+ * the password matches.
+ * @param peerKey the digest of the peer certificate
+ * @param user the user, NULL if unknown
+ * @param password the password given
+ * @return true if password is the one of user
+ */
+bool UserPassProcessor::Verify(const string& peerKey, User *user,
+                               grpc::string_ref password)
+{
+  Digest digest;
+  unsigned int size;
+
+  HMAC(EVP_sha256(), digestKey.data(), digestKey.size(),
+       reinterpret_cast<const unsigned char *>(password.data()),
+       password.size(), digest.data(), &size);
+
+  std::unique_lock<std::mutex> lock(mtx);
+  Peer& peer = FindPeer(peerKey);
+  if (user) {
+    auto cached = peer.verified.find(user->name);
+    if (cached != peer.verified.end() &&
+        CRYPTO_memcmp(cached->second.data(), digest.data(),
+                      digest.size()) == 0)
+      return true;
+  }
+
+  // A wrong password costs a hash, only a few are hashed per second for a
+  // peer. The token is spent now so that concurrent RPCs can not all pass.
+  steady_clock::time_point now = steady_clock::now();
+  peer.tokens = std::min<double>(FAILURE_BURST, peer.tokens + FAILURE_RATE *
+                                 duration<double>(now - peer.refillAt).count());
+  peer.refillAt = now;
+  if (peer.tokens < 1)
+    return false;
+  peer.tokens--;
+  lock.unlock();
+
+  string hash = Hash(password.data(), password.size(),
+                     user ? user->salt : dummySalt,
+                     user ? user->rounds : dummyRounds);
+  bool match = user &&
+    CRYPTO_memcmp(hash.data(), user->hash.data(), HASH_SIZE) == 0;
+
+  if (match) {
+    // The peer may have been forgotten meanwhile
+    lock.lock();
+    Peer& again = FindPeer(peerKey);
+    again.tokens = std::min<double>(FAILURE_BURST, again.tokens + 1);
+    again.verified[user->name] = digest;
+  }
+
+  return match;
+}
+
+/* Fail - Reject an RPC, logging at most one failure a second so that
+ * repeated attempts do not flood the logs
+ * @param reason why the RPC is rejected
+ * @return UNAUTHENTICATED status
+ */
+Status UserPassProcessor::Fail(const char *reason)
+{
+  std::lock_guard<std::mutex> lock(mtx);
+
+  failures++;
+  if (steady_clock::now() >= logAt) {
+    std::cerr << reason << " (" << failures << " authentication failure(s)"
+      << " since last report)" << std::endl;
+    failures = 0;
+    logAt = steady_clock::now() + seconds(1);
+  }
+
+  return grpc::Status(grpc::StatusCode::UNAUTHENTICATED, reason);
+}
+
+/* Implement a MetadataProcessor for username/password authentication */
+Status UserPassProcessor::Process(const InputMetadata& auth_metadata,
+                                      grpc::AuthContext* context,
+                                      OutputMetadata* consumed_auth_metadata,
+                                      OutputMetadata* response_metadata)
+{
+  /* Look for username/password fields in Metadata sent by client */
+  auto user_kv = auth_metadata.find("username");
+  if (user_kv == auth_metadata.end())
+    return Fail("No username field");
+  auto pass_kv = auth_metadata.find("password");
+  if (pass_kv == auth_metadata.end())
+    return Fail("No password field");
+
+  /* test if username and password are good */
+  if (!Verify(PeerKey(context), Find(user_kv->second), pass_kv->second))
+    return Fail("Invalid username/password");
+
+  /* Remove username and password key-value from metadata */
+  consumed_auth_metadata->insert(std::make_pair(
+        string(user_kv->first.data(), user_kv->first.length()),
+        string(user_kv->second.data(), user_kv->second.length())));
+  consumed_auth_metadata->insert(std::make_pair(
+        string(pass_kv->first.data(), pass_kv->first.length()),
+        string(pass_kv->second.data(), pass_kv->second.length())));
+
+  return grpc::Status::OK;
+}
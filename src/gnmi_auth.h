@@ -0,0 +1,83 @@
+/*  vim:set softtabstop=2 shiftwidth=2 tabstop=2 expandtab: */
+
+#ifndef GNMI_AUTH_H
+#define GNMI_AUTH_H
+
+#include <map>
+#include <array>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <grpcpp/security/auth_metadata_processor.h>
+
+using grpc::Status;
+
+/*
+ * Authenticate RPCs from username and password fields of their metadata.
+ * Passwords are checked against PBKDF2-HMAC-SHA256 hashes. State is kept per
+ * peer, identified by its client certificate: a keyed digest of the last
+ * password verified for a user from that peer is compared first to skip
+ * hashing on every RPC, and wrong passwords spend tokens of the bucket of
+ * the peer, whose passwords are not hashed while it is empty. A peer flooding
+ * wrong passwords does not slow down others.
+ */
+class UserPassProcessor final : public grpc::AuthMetadataProcessor {
+  public:
+    UserPassProcessor();
+
+    Status Process(const InputMetadata& auth_metadata,
+                   grpc::AuthContext* context,
+                   OutputMetadata* consumed_auth_metadata,
+                   OutputMetadata* response_metadata) override;
+
+    /* Add users of a file of USER:ROUNDS:SALT:HASH lines, false on error */
+    bool LoadUsers(const std::string& path);
+    /* Add a user, hashing its password with a random salt */
+    void AddUser(const std::string& name, const std::string& password);
+
+  private:
+    /* HMAC-SHA256 of a password under a key drawn at startup */
+    typedef std::array<unsigned char, 32> Digest;
+
+    struct User {
+      std::string name;
+      unsigned int rounds;
+      std::string salt, hash;
+    };
+
+    /* Authentication state of a client certificate */
+    struct Peer {
+      /* Wrong passwords still allowed to be hashed, refilled over time */
+      double tokens;
+      std::chrono::steady_clock::time_point refillAt;
+      std::chrono::steady_clock::time_point seenAt;
+      /* Digest of the password last found to match, by user name */
+      std::map<std::string, Digest> verified;
+    };
+
+    User *Find(grpc::string_ref name);
+    Peer& FindPeer(const std::string& key);
+    bool Verify(const std::string& peerKey, User *user,
+                grpc::string_ref password);
+    Status Fail(const char *reason);
+
+    /* Fixed once the server runs */
+    std::vector<User> users;
+    std::string digestKey;
+    /* Unknown users are hashed with them, costing as much as known ones,
+     * rounds being the most of any user */
+    std::string dummySalt;
+    unsigned int dummyRounds;
+
+    std::mutex mtx;
+    /* Peers by digest of their certificate, the least recently seen one
+     * dropped beyond MAX_PEERS */
+    std::map<std::string, Peer> peers;
+    /* Failures since the last one logged */
+    unsigned int failures = 0;
+    std::chrono::steady_clock::time_point logAt;
+};
+
+#endif // GNMI_AUTH_H
@@ -6,12 +6,11 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
-
-extern "C" {
-#include <vpp-api/client/stat_client.h>
-}
+#include <regex>
 
 #include "gnmi_collector.h"
+#include "gnmi_telemetry.h"
+#include "gnmi_pool.h"
 
 using namespace std;
 using namespace gnmi;
@@ -56,16 +55,18 @@ void UnixToGnmiPath(string unixp, Path* path)
 
 /* createPatterns - Create a VPP vector containing set of paths as parameter for
  * stat_segment_ls.
- * @param metric UNIX paths to shared memory stats counters.
+ * @param metrics UNIX paths to shared memory stats counters.
  * @return VPP vector containing UNIX paths or NULL in case of failure.
  */
-u8 ** createPatterns(string metric)
+u8 ** createPatterns(const vector<string>& metrics)
 {
   u8 **patterns = 0;
 
-  patterns = stat_segment_string_vector(patterns, metric.c_str());
-  if (!patterns)
-    exit(-ENOMEM);
+  for (auto& metric : metrics) {
+    patterns = stat_segment_string_vector(patterns, metric.c_str());
+    if (!patterns)
+      exit(-ENOMEM);
+  }
 
   return patterns;
 }
@@ -78,86 +79,982 @@ void freePatterns(u8 **patterns)
   stat_segment_vec_free(patterns);
 }
 
-/* addIntCounter - Add a new Update in Notification answer with uint64 value
+/* Changed - Record the value of a leaf.
+ * @param key LeafKey of the counter.
+ * @param value value just read.
+ * @return true if the leaf is new or its value differs from the last one.
+ */
+bool LastValueCache::Changed(uint64_t key, uint64_t value)
+{
+  auto res = values.emplace(key, value);
+  if (res.second)
+    return true;
+  if (res.first->second == value)
+    return false;
+
+  res.first->second = value;
+  return true;
+}
+
+/* Leaves - Optional output of FillCounters: key and value of each Update */
+struct Leaves {
+  vector<uint64_t> *keys;
+  vector<uint64_t> *values;
+};
+
+/* addCounter - Add a new Update in Notification answer with uint64 value
  * @param list Update List of Notification answer
- * @param path Unix Path of the counter
+ * @param path gNMI Path of the counter
  * @param value counter value on 64 bits
+ * @param leaves where key and value of the leaf are recorded, if requested
+ * @param key LeafKey of the counter
  */
 static inline void
-addIntCounter(RepeatedPtrField<Update> *list, string path, uint64_t value)
+addCounter(RepeatedPtrField<Update> *list, const Path& path, uint64_t value,
+              Leaves& leaves, uint64_t key)
 {
     Update* update = list->Add();
 
-    UnixToGnmiPath(path, update->mutable_path());
-    update->mutable_val()->set_int_val(value);
+    update->mutable_path()->CopyFrom(path);
+    update->mutable_val()->set_uint_val(value);
     update->set_duplicates(0);
+
+    if (leaves.keys)
+      leaves.keys->push_back(key);
+    if (leaves.values)
+      leaves.values->push_back(value);
+}
+
+/* Truncate - Drop the Updates of list past size, and their leaves */
+static void Truncate(RepeatedPtrField<Update> *list, int size, Leaves& leaves)
+{
+  size_t n = list->size() - size;
+
+  list->DeleteSubrange(size, n);
+  if (leaves.keys)
+    leaves.keys->resize(leaves.keys->size() - n);
+  if (leaves.values)
+    leaves.values->resize(leaves.values->size() - n);
+}
+
+IfTablePtr CounterSource::ifTable = make_shared<const IfTable>();
+
+/* GetIfTable - Get a snapshot of interface names. It stays valid as long as
+ * the caller holds it, even if a newer table is published meanwhile. */
+IfTablePtr CounterSource::GetIfTable()
+{
+  return atomic_load(&ifTable);
+}
+
+/* PublishIfTable - Replace the interface table at once, readers never wait
+ * for it. */
+void CounterSource::PublishIfTable(IfTablePtr table)
+{
+  atomic_store(&ifTable, table);
+}
+
+/* LeafPath - Get gNMI Path of a counter leaf, built on first use only.
+ * @param paths where a Path missing from pathCache is built, pathCache
+ * itself unless building leaves in parallel.
+ * @param key LeafKey of the counter.
+ * @param name stat segment name of the counter.
+ * @param iface interface index in pathIfTable, or -1 for counters not per
+ * interface.
+ * @param thread thread number of per interface counters, or -1 for counters
+ * summed over threads.
+ * @param field last element of combined counters, or NULL.
+ * @return Path owned by the cache, valid until next FillCounters call.
+ */
+const Path& StatConnector::LeafPath(PathMap& paths, uint64_t key,
+                                   const char *name, int iface, int thread,
+                                   const char *field) const
+{
+  auto it = pathCache.find(key);
+  if (it != pathCache.end())
+    return it->second;
+  auto res = paths.emplace(key, Path());
+  if (!res.second)
+    return res.first->second;
+
+  //path = counter + ifacename + thread num
+  Path& path = res.first->second;
+  UnixToGnmiPath(name, &path);
+  if (iface >= 0) {
+    if ((size_t)iface < pathIfTable->size() && !(*pathIfTable)[iface].empty())
+      path.add_elem()->set_name((*pathIfTable)[iface]);
+    if (thread >= 0)
+      path.add_elem()->set_name("T" + to_string(thread));
+  }
+  if (field)
+    path.add_elem()->set_name(field);
+
+  return path;
+}
+
+/* AddCounters - Add n counters of v to sums. Kept as a plain loop over
+ * non-aliased arrays so that the compiler vectorizes it. */
+static inline void AddCounters(uint64_t *__restrict sums,
+                               const uint64_t *__restrict v, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    sums[i] += v[i];
+}
+
+/* Interfaces - Number of interfaces of a per interface entry */
+static size_t Interfaces(const CounterEntry& entry)
+{
+  size_t n = 0;
+
+  for (auto len : entry.lengths)
+    n = max(n, len);
+
+  return n;
+}
+
+/* SumThreads - Sum per thread counter arrays of an entry into sums.
+ * Combined counters are summed as flat arrays of packets/bytes pairs.
+ * @param entry a SIMPLE or COMBINED entry.
+ * @param width number of values per interface.
+ * @param first first interface summed.
+ * @param last interface past the last one summed.
+ * @param sums filled with the sums of interfaces [first, last).
+ */
+static void SumThreads(const CounterEntry& entry, size_t width, size_t first,
+                       size_t last, vector<uint64_t>& sums)
+{
+  sums.assign((last - first) * width, 0);
+  for (size_t k = 0; k < entry.threads.size(); k++)
+    if (entry.lengths[k] > first)
+      AddCounters(sums.data(), entry.threads[k] + first * width,
+                  (min(last, entry.lengths[k]) - first) * width);
+}
+
+/* Maximum number of compiled paths kept by StatConnector */
+static const size_t MATCHER_CACHE_SIZE = 1024;
+
+/* Matcher - Get the compiled form of a path, compiled on first use only.
+ * @param path UNIX path as written by GnmiToUnixPath.
+ */
+const PathMatcher& StatConnector::Matcher(const string& path)
+{
+  auto it = matchers.find(path);
+  if (it == matchers.end())
+    it = matchers.emplace(path, PathMatcher(path)).first;
+
+  return it->second;
+}
+
+/* Select - Find the cells of an entry matched by any path of the current
+ * FillCounters call. Counter names are matched first, so that every cell
+ * is only checked when a path goes below them or has key filters.
+ * @param entry entry read from a source.
+ * @param aggregate if true, counters are summed over threads.
+ * @param selected filled with the cells matched.
+ * @return false if no leaf of the entry matches.
+ */
+bool StatConnector::Select(const CounterEntry& entry, bool aggregate,
+                           Cells& selected)
+{
+  bool found = false;
+
+  selected.all = false;
+  states.clear();
+  for (auto matcher : selection) {
+    PathMatcher::States s = matcher->Match(entry.name);
+    states.push_back(s);
+    if (matcher->Accepts(s) && !matcher->Filters()) {
+      selected.all = true;
+      return true;
+    }
+    found |= s != 0;
+  }
+  // Below a scalar there is nothing to match, nor to filter on
+  if (!found || entry.type == CounterEntry::SCALAR)
+    return false;
+
+  size_t n = Interfaces(entry);
+  size_t cellWidth = aggregate ? 1 : entry.threads.size();
+  selected.width = cellWidth;
+  selected.bits.assign(n * cellWidth, 0);
+  found = false;
+
+  for (size_t m = 0; m < selection.size(); m++) {
+    const PathMatcher& matcher = *selection[m];
+    if (!states[m])
+      continue;
+    for (size_t j = 0; j < n; j++) {
+      // Same elements as LeafPath
+      PathMatcher::States si = states[m];
+      if (j < pathIfTable->size() && !(*pathIfTable)[j].empty()) {
+        const string& name = (*pathIfTable)[j];
+        if (!matcher.Interface().empty() && matcher.Interface() != name)
+          continue;
+        si = matcher.Step(si, name);
+      } else if (!matcher.Interface().empty()) {
+        continue;
+      }
+      if (!si)
+        continue;
+
+      // Sums have no thread to filter on
+      if (aggregate && matcher.Thread() >= 0)
+        continue;
+      for (size_t k = 0; k < cellWidth; k++) {
+        PathMatcher::States sk = si;
+        if (!aggregate) {
+          if (matcher.Thread() >= 0 && (size_t)matcher.Thread() != k)
+            continue;
+          sk = matcher.Step(si, "T" + to_string(k));
+        }
+
+        uint8_t bits = 0;
+        if (entry.type == CounterEntry::COMBINED) {
+          bits |= matcher.Accepts(matcher.Step(sk, "packets")) << 0;
+          bits |= matcher.Accepts(matcher.Step(sk, "bytes")) << 1;
+        } else {
+          bits |= matcher.Accepts(sk);
+        }
+        selected.bits[j * cellWidth + k] |= bits;
+        found |= bits != 0;
+      }
+    }
+  }
+
+  return found;
+}
+
+/* AddLeaves - Add Updates of the selected cells of a piece of an entry.
+ * Only reads the state of the connector, so that pieces can be built by
+ * several threads at once.
+ * @param list Update List of Notification answer
+ * @param e entry read from a source.
+ * @param selected cells of the entry selected by Select.
+ * @param piece interfaces and threads of the entry to add.
+ * @param leaves where key and value of each Update are recorded, if requested
+ * @param aggregate if true, per interface counters are summed over threads.
+ * @param paths where missing leaf Paths are built, see LeafPath.
+ */
+void StatConnector::AddLeaves(RepeatedPtrField<Update> *list,
+                              const CounterEntry& e, const Cells& selected,
+                              const Piece& piece, Leaves& leaves,
+                              bool aggregate, PathMap& paths) const
+{
+  vector<uint64_t> sums;
+
+  switch (e.type) {
+    case CounterEntry::SIMPLE:
+      if (aggregate) {
+        SumThreads(e, 1, piece.first, piece.last, sums);
+        for (size_t j = piece.first; j < piece.last; j++) {
+          if (!selected.Selected(j, 0, 0))
+            continue;
+          uint64_t key = LeafKey(e.index, j, ALL_THREADS, 0);
+          addCounter(list, LeafPath(paths, key, e.name, j, -1, NULL),
+                        sums[j - piece.first], leaves, key);
+        }
+        break;
+      }
+      for (size_t k = piece.firstThread; k < piece.lastThread; k++)
+        for (size_t j = piece.first; j < min(piece.last, e.lengths[k]); j++) {
+          if (!selected.Selected(j, k, 0))
+            continue;
+          uint64_t key = LeafKey(e.index, j, k, 0);
+          addCounter(list, LeafPath(paths, key, e.name, j, k, NULL),
+                        e.threads[k][j], leaves, key);
+        }
+      break;
+    case CounterEntry::COMBINED:
+      if (aggregate) {
+        SumThreads(e, 2, piece.first, piece.last, sums);
+        for (size_t j = piece.first; j < piece.last; j++) {
+          size_t s = 2 * (j - piece.first);
+          uint64_t key = LeafKey(e.index, j, ALL_THREADS, 0);
+          if (selected.Selected(j, 0, 0))
+            addCounter(list, LeafPath(paths, key, e.name, j, -1, "packets"),
+                          sums[s], leaves, key);
+          key = LeafKey(e.index, j, ALL_THREADS, 1);
+          if (selected.Selected(j, 0, 1))
+            addCounter(list, LeafPath(paths, key, e.name, j, -1, "bytes"),
+                          sums[s + 1], leaves, key);
+        }
+        break;
+      }
+      for (size_t k = piece.firstThread; k < piece.lastThread; k++)
+        for (size_t j = piece.first; j < min(piece.last, e.lengths[k]); j++) {
+          uint64_t key = LeafKey(e.index, j, k, 0);
+          if (selected.Selected(j, k, 0))
+            addCounter(list, LeafPath(paths, key, e.name, j, k, "packets"),
+                          e.threads[k][2 * j], leaves, key);
+          key = LeafKey(e.index, j, k, 1);
+          if (selected.Selected(j, k, 1))
+            addCounter(list, LeafPath(paths, key, e.name, j, k, "bytes"),
+                          e.threads[k][2 * j + 1], leaves, key);
+        }
+      break;
+    case CounterEntry::SCALAR:
+      {
+        uint64_t key = LeafKey(e.index, 0, 0, 0);
+        addCounter(list, LeafPath(paths, key, e.name, -1, 0, NULL),
+                      e.value, leaves, key);
+        break;
+      }
+  }
+}
+
+/* AddEntry - Add Updates of the cells of an entry selected by Select.
+ * @param list Update List of Notification answer
+ * @param e entry read from a source.
+ * @param keys if not NULL, LeafKey of each Update appended to list.
+ * @param values if not NULL, value of each Update appended to list.
+ * @param aggregate if true, per interface counters are summed over threads.
+ */
+void StatConnector::AddEntry(RepeatedPtrField<Update> *list,
+                             const CounterEntry& e, vector<uint64_t> *keys,
+                             vector<uint64_t> *values, bool aggregate)
+{
+  Leaves leaves = {keys, values};
+  Piece all;
+
+  all.first = 0;
+  all.last = Interfaces(e);
+  all.firstThread = 0;
+  all.lastThread = e.threads.size();
+  AddLeaves(list, e, cells, all, leaves, aggregate, pathCache);
+}
+
+/* Leaves of the pieces built by one task of a parallel read */
+static const size_t TASK_LEAVES = 2048;
+
+/* Split - Select the cells of every entry read and cut them in pieces of at
+ * most TASK_LEAVES leaves, by thread then interface range so that pieces
+ * keep the order of leaves of AddEntry.
+ * @param aggregate if true, counters are summed over threads.
+ * @return number of leaves in pieces, counting every cell of an entry.
+ */
+size_t StatConnector::Split(bool aggregate)
+{
+  size_t total = 0;
+
+  selections.resize(entries.size());
+  pieces.clear();
+  for (size_t i = 0; i < entries.size(); i++) {
+    const CounterEntry& e = entries[i];
+    if (!Select(e, aggregate, selections[i]))
+      continue;
+
+    size_t n = e.type == CounterEntry::SCALAR ? 1 : Interfaces(e);
+    size_t width = e.type == CounterEntry::COMBINED ? 2 : 1;
+    size_t step = TASK_LEAVES / width;
+    size_t threads = aggregate || e.type == CounterEntry::SCALAR ? 1
+                                                               : e.threads.size();
+    for (size_t k = 0; k < threads; k++)
+      for (size_t j = 0; j < n; j += step) {
+        pieces.emplace_back();
+        Piece& piece = pieces.back();
+        piece.entry = i;
+        piece.first = j;
+        piece.last = min(n, j + step);
+        piece.firstThread = aggregate ? 0 : k;
+        piece.lastThread = aggregate ? e.threads.size() : k + 1;
+        piece.size = (piece.last - piece.first) * width;
+        total += piece.size;
+      }
+  }
+
+  return total;
+}
+
+/* FillParallel - Build the pieces of Split on the WorkPool and append them
+ * to list in order. Consecutive small pieces, e.g. error counters, are
+ * built by the same task. Entries read in place are then checked in order,
+ * those moved meanwhile are built again, as by FillCounters.
+ * @param list Update List of Notification answer
+ * @param fromSource number of leading entries read from source.
+ * @param leaves where key and value of each Update are recorded, if requested
+ * @param aggregate if true, counters are summed over threads.
+ * @return false if the directory has changed, entries have to be read again.
+ */
+bool StatConnector::FillParallel(RepeatedPtrField<Update> *list,
+                                 size_t fromSource, Leaves& leaves,
+                                 bool aggregate)
+{
+  vector<WorkPool::Task> tasks;
+  vector<PathMap> paths;
+  vector<pair<size_t, size_t>> ranges; // pieces of each task
+
+  for (size_t p = 0, size = 0; p < pieces.size(); p++) {
+    if (size == 0)
+      ranges.emplace_back(p, p);
+    ranges.back().second = p + 1;
+    size += pieces[p].size;
+    if (size >= TASK_LEAVES)
+      size = 0;
+  }
+
+  paths.resize(ranges.size());
+  for (size_t t = 0; t < ranges.size(); t++)
+    tasks.push_back([this, t, &ranges, &paths, &leaves, aggregate]() {
+      for (size_t p = ranges[t].first; p < ranges[t].second; p++) {
+        Piece& piece = pieces[p];
+        Leaves own = {leaves.keys ? &piece.keys : NULL,
+                      leaves.values ? &piece.values : NULL};
+        AddLeaves(&piece.updates, entries[piece.entry],
+                  selections[piece.entry], piece, own, aggregate, paths[t]);
+      }
+    });
+  WorkPool::Run(tasks);
+
+  for (auto& built : paths)
+    for (auto& path : built)
+      pathCache.emplace(path.first, move(path.second));
+
+  // Counters read in place may have been moved while in use
+  for (size_t p = 0; p < pieces.size();) {
+    size_t i = pieces[p].entry;
+    size_t end = p;
+    while (end < pieces.size() && pieces[end].entry == i)
+      end++;
+    for (bool moved = i < fromSource; moved;) {
+      moved = false;
+      switch (source.Validate(entries[i])) {
+        case CounterSource::VALID:
+          break;
+        case CounterSource::ENTRY_MOVED:
+          moved = true;
+          for (size_t q = p; q < end; q++) {
+            pieces[q].updates.Clear();
+            pieces[q].keys.clear();
+            pieces[q].values.clear();
+          }
+          if (Select(entries[i], aggregate, cells))
+            AddEntry(&pieces[p].updates, entries[i],
+                     leaves.keys ? &pieces[p].keys : NULL,
+                     leaves.values ? &pieces[p].values : NULL, aggregate);
+          else
+            moved = false;
+          break;
+        case CounterSource::STALE:
+          return false;
+      }
+    }
+    p = end;
+  }
+
+  // Updates are moved, not copied
+  for (auto& piece : pieces) {
+    int n = piece.updates.size();
+    vector<Update *> built(n);
+    piece.updates.ExtractSubrange(0, n, built.data());
+    for (auto update : built)
+      list->AddAllocated(update);
+    if (leaves.keys)
+      leaves.keys->insert(leaves.keys->end(), piece.keys.begin(),
+                          piece.keys.end());
+    if (leaves.values)
+      leaves.values->insert(leaves.values->end(), piece.values.begin(),
+                            piece.values.end());
+  }
+
+  return true;
+}
+
+/* Below this number of leaves, a read is not worth spreading over threads */
+static const size_t PARALLEL_MIN_LEAVES = 2 * TASK_LEAVES;
+
+/** FillCounters - Fill val with counter value collected from the source
+ * @param list Update List of Notification answer
+ * @param metrics UNIX paths of requested counters, see PathMatcher, all
+ * read by a single scan of the source.
+ * @param keys if not NULL, LeafKey of each Update appended to list.
+ * @param values if not NULL, value of each Update appended to list.
+ * @param aggregate if true, per interface counters are summed over threads
+ * instead of being reported per thread.
+ */
+void StatConnector::FillCounters(RepeatedPtrField<Update> *list,
+                                 const vector<string>& metrics,
+                                 vector<uint64_t> *keys,
+                                 vector<uint64_t> *values, bool aggregate)
+{
+  vector<string> own, others;
+
+  if (matchers.size() + metrics.size() > MATCHER_CACHE_SIZE)
+    matchers.clear();
+  selection.clear();
+  for (auto& metric : metrics) {
+    const PathMatcher& matcher = Matcher(metric);
+    selection.push_back(&matcher);
+    matcher.Patterns(false, others);
+    if (telemetry)
+      matcher.Patterns(true, own);
+  }
+
+  // Counters read in place may be moved while in use: the Updates of an
+  // entry are built again, or of every entry if the directory has changed
+  Leaves leaves = {keys, values};
+  int start = list->size();
+  for (bool stale = true; stale;) {
+    stale = false;
+    Truncate(list, start, leaves);
+
+    entries.clear();
+    size_t fromSource;
+    {
+      Telemetry::Timer timer(Telemetry::STAT_DUMP_NS);
+      bool found = false;
+      if (!others.empty())
+        found |= source.Read(others, entries);
+      fromSource = entries.size();
+      if (!own.empty())
+        found |= telemetry->Read(own, entries);
+      if (!found) {
+        cerr << "No pattern was found" << endl;
+        return;
+      }
+    }
+
+    // Cached paths hold segment indexes and interface names. Telemetry leaf
+    // indexes never change.
+    uint64_t epoch = source.Epoch();
+    IfTablePtr ifTable = CounterSource::GetIfTable();
+    if (epoch != pathEpoch || ifTable != pathIfTable) {
+      pathCache.clear();
+      pathEpoch = epoch;
+      pathIfTable = ifTable;
+    }
+
+    if (WorkPool::Width() > 1 && Split(aggregate) >= PARALLEL_MIN_LEAVES) {
+      stale = !FillParallel(list, fromSource, leaves, aggregate);
+      pieces.clear();
+      continue;
+    }
+
+    // Iterate over all subdirectories of requested path
+    for (size_t i = 0; i < entries.size() && !stale; i++) {
+      CounterEntry& e = entries[i];
+      int size = list->size();
+      for (bool moved = true; moved;) {
+        moved = false;
+        if (!Select(e, aggregate, cells))
+          break;
+        AddEntry(list, e, keys, values, aggregate);
+        if (i >= fromSource)
+          break;
+        switch (source.Validate(e)) {
+          case CounterSource::VALID:
+            break;
+          case CounterSource::ENTRY_MOVED:
+            moved = true;
+            Truncate(list, size, leaves);
+            break;
+          case CounterSource::STALE:
+            stale = true;
+            break;
+        }
+      }
+    }
+  }
+}
+
+//////////////////////////////////////////////////////////////
+
+/* Maximum number of patterns kept in index caches */
+static const size_t INDEX_CACHE_SIZE = 1024;
+
+/* Lookup - Get indexes of names matching any pattern, compiling patterns
+ * only when they have never been resolved.
+ * @param patterns regexes on names.
+ * @param size number of names.
+ * @param name gives the name at an index.
+ * @return indexes owned by the cache, empty if no name matches.
+ */
+const vector<u32>& NameIndexCache::Lookup(const vector<string>& patterns,
+    u32 size, const function<const string&(u32)>& name)
+{
+  string key;
+  for (auto& pattern : patterns)
+    key += (key.empty() ? "" : "\n") + pattern;
+
+  auto it = indexes.find(key);
+  if (it != indexes.end())
+    return it->second;
+
+  if (indexes.size() >= INDEX_CACHE_SIZE)
+    indexes.clear();
+
+  vector<regex> res;
+  for (auto& pattern : patterns) {
+    try {
+      res.emplace_back(pattern);
+    } catch (const regex_error& e) {
+      cerr << "Invalid pattern " << pattern << endl;
+    }
+  }
+  vector<u32>& found = indexes[key];
+  for (u32 i = 0; i < size; i++)
+    for (auto& re : res)
+      if (regex_search(name(i), re)) {
+        found.push_back(i);
+        break;
+      }
+
+  return found;
+}
+
+/* SegmentEpoch - Get stat segment epoch. VPP increments it each time the
+ * directory layout changes, i.e. when counters are added or removed. */
+static inline uint64_t SegmentEpoch()
+{
+  return stat_client_main.shared_header->epoch;
+}
+
+/* FlushIndexCache - Release every cached index vector */
+void VppCounterSource::FlushIndexCache()
+{
+  for (auto& entry : indexCache)
+    stat_segment_vec_free(entry.second.stats);
+  indexCache.clear();
+}
+
+/* Lookup - Get stat segment indexes of counters matching patterns.
+ * stat_segment_ls is only run when the patterns have never been resolved or
+ * when the segment epoch has changed since they were.
+ * @param metrics UNIX path patterns of requested counters.
+ * @return VPP vector of indexes owned by the cache, or NULL if none matches.
+ */
+u32 * VppCounterSource::Lookup(const vector<string>& metrics)
+{
+  uint64_t epoch = SegmentEpoch();
+  string metric;
+
+  for (auto& m : metrics)
+    metric += (metric.empty() ? "" : "\n") + m;
+
+  auto it = indexCache.find(metric);
+  if (it != indexCache.end()) {
+    if (it->second.epoch == epoch) {
+      Telemetry::Add(Telemetry::INDEX_CACHE_HITS);
+      return it->second.stats;
+    }
+    // Directory has changed, every entry is stale
+    FlushIndexCache();
+  }
+  Telemetry::Add(Telemetry::INDEX_CACHE_MISSES);
+
+  if (indexCache.size() >= INDEX_CACHE_SIZE)
+    FlushIndexCache();
+
+  u8 **patterns = createPatterns(metrics);
+  u32 *stats = stat_segment_ls(patterns);
+  freePatterns(patterns);
+  if (!stats)
+    return NULL;
+
+  indexCache[metric] = {stats, epoch};
+
+  return stats;
+}
+
+static_assert(sizeof(vlib_counter_t) == 2 * sizeof(counter_t),
+              "combined counters are read as pairs of 64 bits counters");
+
+/* Size of the header of VPP vectors, before their first element */
+static const uint64_t VEC_HEADER_SIZE = 8;
+
+/* SegmentPointer - Get a pointer to size bytes at offset in the stat
+ * segment. Offsets read while VPP modifies the directory may be garbage, so
+ * NULL is returned unless the bytes and a vector header before them are all
+ * inside the segment.
+ */
+static inline const void * SegmentPointer(uint64_t offset, uint64_t size)
+{
+  uint64_t limit = stat_client_main.memory_size;
+
+  if (offset < VEC_HEADER_SIZE || offset > limit || size > limit - offset)
+    return NULL;
+
+  return stat_segment_pointer(stat_client_main.shared_header, offset);
+}
+
+/* SegmentVector - Get a VPP vector of the stat segment.
+ * @param offset offset of the vector in the segment.
+ * @param width size of an element.
+ * @param len set to the number of elements.
+ * @return the vector, NULL if it is not all inside the segment.
+ */
+static inline const void * SegmentVector(uint64_t offset, size_t width,
+                                         size_t& len)
+{
+  const void *v = SegmentPointer(offset, 0);
+  if (!v)
+    return NULL;
+
+  len = stat_segment_vec_len(const_cast<void *>(v));
+  return SegmentPointer(offset, len * width);
+}
+
+/* StartAccess - Open a new access window on the stat segment, once VPP has
+ * completed any directory change in progress. */
+void VppCounterSource::StartAccess()
+{
+  stat_segment_access_start(&access, &stat_client_main);
+  window++;
 }
 
-/** FillCounters - Fill val with counter value collected with STAT API
- * @param val counter value answered to gNMI client
- * @param patterns VPP vector containing UNIX path of stats counter.
+/* ReadEntry - Point an entry to counters of the stat segment, in place, the
+ * same way stat_segment_dump copies them. Called within an access window.
+ * @param index index of the counter in the directory.
+ * @param e entry filled, its name is NULL if its type is not supported.
+ * @return false if the directory is inconsistent, i.e. being modified.
  */
-void StatConnector::FillCounters(RepeatedPtrField<Update> *list, string metric)
+bool VppCounterSource::ReadEntry(u32 index, CounterEntry& e)
+{
+  stat_client_main_t *sm = &stat_client_main;
+  size_t n, len;
+
+  if (index >= (u32)stat_segment_vec_len(sm->directory_vector))
+    return false;
+  stat_segment_directory_entry_t *ep = &sm->directory_vector[index];
+
+  e.index = index;
+  e.name = ep->name;
+  e.value = 0;
+  e.version = window;
+  e.threads.clear();
+  e.lengths.clear();
+  switch (ep->type) {
+    case STAT_DIR_TYPE_COUNTER_VECTOR_SIMPLE:
+    case STAT_DIR_TYPE_COUNTER_VECTOR_COMBINED:
+      {
+        size_t width = ep->type == STAT_DIR_TYPE_COUNTER_VECTOR_SIMPLE ? 1 : 2;
+        e.type = width == 1 ? CounterEntry::SIMPLE : CounterEntry::COMBINED;
+        if (ep->offset == 0)
+          break;
+        // Vector of per thread vectors, whose offsets are in offset_vector
+        if (!SegmentVector(ep->offset, sizeof(void *), n))
+          return false;
+        const uint64_t *offsets = static_cast<const uint64_t *>(
+            SegmentPointer(ep->offset_vector, n * sizeof(uint64_t)));
+        if (!offsets)
+          return false;
+        for (size_t k = 0; k < n; k++) {
+          const void *v = SegmentVector(offsets[k], width * sizeof(counter_t),
+                                        len);
+          if (!v)
+            return false;
+          e.threads.push_back(static_cast<const uint64_t *>(v));
+          e.lengths.push_back(len);
+        }
+        break;
+      }
+    case STAT_DIR_TYPE_ERROR_INDEX:
+      {
+        const counter_t *errors = static_cast<const counter_t *>(
+            SegmentPointer(sm->shared_header->error_offset,
+                           (ep->index + 1) * sizeof(counter_t)));
+        if (!errors)
+          return false;
+        e.type = CounterEntry::SCALAR;
+        e.value = errors[ep->index];
+        break;
+      }
+    case STAT_DIR_TYPE_SCALAR_INDEX:
+      e.type = CounterEntry::SCALAR;
+      e.value = ep->value;
+      break;
+    default:
+      cerr << "Unknown value" << endl;
+      e.name = NULL;
+  }
+
+  return true;
+}
+
+/* Number of times in a row an entry is read again in place before its
+ * counters are copied */
+static const int MAX_MOVES = 3;
+
+/* Number of inconsistent reads of the directory, e.g. while VPP keeps
+ * changing it or when an entry holds garbage, before counters are read
+ * from a dump */
+static const int MAX_RETRIES = 16;
+
+/* CopyEntry - Copy the counters of an entry read in place, to be used
+ * however long VPP keeps moving them.
+ * @param e entry read in the current window, pointing to the copy after.
+ * @return false if the window was broken during the copy.
+ */
+bool VppCounterSource::CopyEntry(CounterEntry& e)
+{
+  size_t width = e.type == CounterEntry::COMBINED ? 2 : 1;
+
+  for (size_t k = 0; k < e.threads.size(); k++) {
+    copies.emplace_back(e.threads[k], e.threads[k] + e.lengths[k] * width);
+    e.threads[k] = copies.back().data();
+  }
+  e.version = 0;
+
+  return stat_segment_access_end(&access, &stat_client_main);
+}
+
+/* Validate - Check that an entry read in place was not moved while its
+ * counters were used, and read it again if it was. VPP bumps the segment
+ * epoch on every change, but counters keep their directory index unless
+ * removed, so an entry is read again at its index as long as it holds the
+ * same counter. Once a window is found broken, entries read in it are read
+ * again in a new one, so a change only costs the entries used after it.
+ * @param entry entry returned by Read.
+ * @return VALID, ENTRY_MOVED if entry has been read again, or STALE if its
+ * index holds another counter or if it could not be read again.
+ */
+CounterSource::Validity VppCounterSource::Validate(CounterEntry& entry)
+{
+  // Copies are never moved
+  if (!inPlace || entry.version == 0)
+    return VALID;
+  bool broken = entry.version == window;
+  if (broken && stat_segment_access_end(&access, &stat_client_main))
+    return VALID;
+
+  Telemetry::Add(Telemetry::SEGMENT_RETRIES);
+  moves = entry.index == movedIndex ? moves + 1 : 1;
+  movedIndex = entry.index;
+  // The name may have been overwritten too, it is only compared
+  string name(entry.name, strnlen(entry.name,
+                                  sizeof(stat_segment_directory_entry_t::name)));
+  for (;; broken = true) {
+    if (broken)
+      StartAccess();
+    if (ReadEntry(entry.index, entry)) {
+      if (!entry.name || name != entry.name)
+        break;
+      if (moves <= MAX_MOVES || CopyEntry(entry))
+        return ENTRY_MOVED;
+    }
+    if (++retries >= MAX_RETRIES)
+      break;
+  }
+
+  // Read again, from a dump once out of retries
+  retries++;
+  staleRead = true;
+  return STALE;
+}
+
+/* Read - Read counters matching patterns from the stat segment, in place
+ * or from a dump, also used once in place reads found the directory
+ * inconsistent MAX_RETRIES times.
+ * @param patterns UNIX path patterns of requested counters.
+ * @param entries where entries pointing to the segment or to the dump are
+ * appended.
+ * @return false if no counter matches.
+ */
+bool VppCounterSource::Read(const vector<string>& patterns,
+                            vector<CounterEntry>& entries)
 {
   stat_segment_data_t *r;
-  u8 ** patterns = createPatterns(metric);
-  u32 *stats = 0;
+  u32 *stats;
 
-  do {
-    stats = stat_segment_ls(patterns);
-    if (!stats) {
-      cerr << "No pattern was found" << endl;
-      return;
+  if (data) {
+    stat_segment_data_free(data);
+    data = NULL;
+  }
+
+  copies.clear();
+  moves = 0;
+  if (!staleRead)
+    retries = 0;
+  staleRead = false;
+  while (inPlace && retries < MAX_RETRIES) {
+    StartAccess();
+    stats = Lookup(patterns);
+    if (!stats)
+      return false;
+
+    size_t n = entries.size();
+    bool consistent = true;
+    for (int i = 0; i < stat_segment_vec_len(stats) && consistent; i++) {
+      CounterEntry e;
+      consistent = ReadEntry(stats[i], e);
+      if (consistent && e.name)
+        entries.push_back(move(e));
     }
+    if (consistent && stat_segment_access_end(&access, &stat_client_main))
+      return true;
+
+    Telemetry::Add(Telemetry::SEGMENT_RETRIES);
+    retries++;
+    entries.resize(n);
+  }
+
+  do {
+    stats = Lookup(patterns);
+    if (!stats)
+      return false;
 
     r = stat_segment_dump(stats);
-  } while (r == 0); /* Memory layout has changed */
+    if (!r) /* Memory layout has changed */
+      FlushIndexCache();
+  } while (r == 0);
+  data = r;
 
-  // Iterate over all subdirectories of requested path
   for (int i = 0; i < stat_segment_vec_len(r); i++) {
+    CounterEntry e;
+    e.index = stats[i];
+    e.name = r[i].name;
+    e.value = 0;
     switch (r[i].type) {
       case STAT_DIR_TYPE_COUNTER_VECTOR_SIMPLE:
-        {
-          int k = 0, j = 0;
-          for (; k < stat_segment_vec_len(r[i].simple_counter_vec); k++)
-            for (; j < stat_segment_vec_len(r[i].simple_counter_vec[k]); j++) {
-              //path = counter + ifacename + thread num
-              string path (r[i].name);
-              path += '/' + VapiConnector::ifMap[j] + "/T" + to_string(k);
-              addIntCounter(list, path, r[i].simple_counter_vec[k][j]);
-            }
-          break;
+        e.type = CounterEntry::SIMPLE;
+        for (int k = 0; k < stat_segment_vec_len(r[i].simple_counter_vec); k++) {
+          e.threads.push_back(r[i].simple_counter_vec[k]);
+          e.lengths.push_back(stat_segment_vec_len(r[i].simple_counter_vec[k]));
         }
+        break;
       case STAT_DIR_TYPE_COUNTER_VECTOR_COMBINED:
-        {
-          int k = 0, j = 0;
-          for (; k < stat_segment_vec_len(r[i].combined_counter_vec); k++)
-            for (; j < stat_segment_vec_len(r[i].combined_counter_vec[k]); j++)
-            {
-              //path = counter + ifacename + thread num
-              string path (r[i].name);
-              path += '/' + VapiConnector::ifMap[j] + "/T" + to_string(k);
-              addIntCounter(list, path + "/packets",
-                  r[i].combined_counter_vec[k][j].packets);
-              addIntCounter(list, path + "/bytes",
-                  r[i].combined_counter_vec[k][j].bytes);
-            }
-          break;
+        e.type = CounterEntry::COMBINED;
+        for (int k = 0; k < stat_segment_vec_len(r[i].combined_counter_vec);
+             k++) {
+          e.threads.push_back(reinterpret_cast<const uint64_t *>(
+                r[i].combined_counter_vec[k]));
+          e.lengths.push_back(
+              stat_segment_vec_len(r[i].combined_counter_vec[k]));
         }
+        break;
       case STAT_DIR_TYPE_ERROR_INDEX:
-        addIntCounter(list, r[i].name, r[i].error_value);
+        e.type = CounterEntry::SCALAR;
+        e.value = r[i].error_value;
         break;
       case STAT_DIR_TYPE_SCALAR_INDEX:
-        addIntCounter(list, r[i].name, r[i].scalar_value);
+        e.type = CounterEntry::SCALAR;
+        e.value = r[i].scalar_value;
         break;
       default:
         cerr << "Unknown value" << endl;
+        continue;
     }
+    entries.push_back(move(e));
   }
+
+  return true;
+}
+
+/* Epoch - Stat segment epoch */
+uint64_t VppCounterSource::Epoch()
+{
+  return SegmentEpoch();
 }
 
-/** Connect to VPP STAT API */
-StatConnector::StatConnector()
+/* WatchInterfaces - Follow VPP interface events */
+void VppCounterSource::WatchInterfaces()
+{
+  vapic.RegisterIfaceEvent();
+}
+
+/** Connect to VPP STAT API
+ * @param inPlace if true, counters are read in place in the stat segment
+ * instead of being copied by stat_segment_dump.
+ */
+VppCounterSource::VppCounterSource(bool inPlace) : inPlace(inPlace)
 {
   char socket_name[] = STAT_SEGMENT_SOCKET_FILE;
   int rc;
@@ -170,8 +1067,11 @@ StatConnector::StatConnector()
 }
 
 /** Disconnect from VPP STAT API */
-StatConnector::~StatConnector()
+VppCounterSource::~VppCounterSource()
 {
+  if (data)
+    stat_segment_data_free(data);
+  FlushIndexCache();
   stat_segment_disconnect();
   cout << "Disconnect STAT socket" << endl;
 }
@@ -198,10 +1098,9 @@ VapiConnector::~VapiConnector() {
   con.disconnect();
 }
 
-std::map <u32, std::string> VapiConnector::ifMap;
-
-/* GetInterfaceDetails - Perform a dump information to fill map between
- * interfaces index and interfaces name.
+/* GetInterfaceDetails - Perform a dump information to fill table between
+ * interfaces index and interfaces name. The new table is built aside and
+ * published at once, readers never wait for it.
  */
 void VapiConnector::GetInterfaceDetails()
 {
@@ -215,13 +1114,19 @@ void VapiConnector::GetInterfaceDetails()
     cerr << "request error" << endl;
 
   con.wait_for_response(req);
+  // Interface deletions are not notified, start from known interfaces
+  shared_ptr<IfTable> table =
+    make_shared<IfTable>(*CounterSource::GetIfTable());
   for (auto& ifMsg : req.get_result_set()) {
     u32 index = ifMsg.get_payload().sw_if_index;
     string name ((char *)ifMsg.get_payload().interface_name);
     //Change '/' in '_' not to mistake with path delimiter
     std::replace(name.begin(), name.end(), '/', '_');
-    ifMap[index] = name; //update index or create new index
+    if (index >= table->size())
+      table->resize(index + 1);
+    (*table)[index] = name; //update index or create new index
   }
+  CounterSource::PublishIfTable(table);
   needUpdate = false;
 }
 
@@ -260,7 +1165,7 @@ void VapiConnector::RegisterIfaceEvent() {
     exit(1);
   }
 
-  /* Thread Loop collecting in charge of updating ifMap */
+  /* Thread Loop collecting in charge of updating ifTable */
   Functor functor(this);
   if_event ev(con, functor);
   GetInterfaceDetails(); //Get Map at the beginning
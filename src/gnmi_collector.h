@@ -1,29 +1,227 @@
 /*  vim:set softtabstop=2 shiftwidth=2 tabstop=2 expandtab: */
 
+#ifndef GNMI_COLLECTOR_H
+#define GNMI_COLLECTOR_H
+
 typedef unsigned int u32;
 typedef unsigned char u8;
 
 #include <map>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <unordered_map>
 #include <vapi/interface.api.vapi.hpp>
 #include <vapi/vapi.hpp>
 #include "../proto/gnmi.grpc.pb.h"
+#include "gnmi_path.h"
+
+extern "C" {
+#include <vpp-api/client/stat_client.h>
+}
 
 using google::protobuf::RepeatedPtrField;
 using gnmi::Update;
+using gnmi::Path;
 using vapi::Connection;
 
 class StatConnector;
 class VapiConnector;
 
+std::vector<std::string> split(const std::string &str, const char &delim);
+void UnixToGnmiPath(std::string unixp, Path* path);
+
+/* Interface names indexed by sw_if_index. A table is never modified once
+ * published, a new one replaces it when interfaces change. */
+typedef std::vector<std::string> IfTable;
+typedef std::shared_ptr<const IfTable> IfTablePtr;
+
+/* Thread number of leaves summed over every thread */
+static const u32 ALL_THREADS = 0xfff;
+
+/* LeafKey - Identify a counter leaf by its stat segment index, interface
+ * index, thread number and field of combined counters (packets/bytes). */
+static inline uint64_t LeafKey(u32 index, u32 iface, u32 thread, u32 field)
+{
+  return ((uint64_t)index << 40) | ((uint64_t)(iface & 0xffffff) << 16)
+    | ((thread & 0xfff) << 4) | (field & 0xf);
+}
+
+/* Last value read for every leaf, used to detect changes between samples */
+class LastValueCache {
+  public:
+    /* Record value of leaf key and tell if it differs from the last one */
+    bool Changed(uint64_t key, uint64_t value);
+    void Clear() {values.clear();};
+
+  private:
+    std::unordered_map<uint64_t, uint64_t> values;
+};
+
+/* One entry of a stats directory as read by a CounterSource. Per interface
+ * counters point to one array per thread, of 1 (simple) or 2 (combined:
+ * packets, bytes) values per interface, owned by the source. */
+struct CounterEntry {
+  enum Type {
+    SIMPLE,   // per interface counters
+    COMBINED, // per interface packets and bytes counters
+    SCALAR    // single value, e.g. error counter
+  };
+
+  Type type;
+  u32 index; // index in directory, valid for the current epoch
+  const char *name;
+  std::vector<const uint64_t *> threads;
+  std::vector<size_t> lengths; // number of interfaces of each thread
+  uint64_t value; // SCALAR only
+  uint64_t version = 0; // read window, for sources reading in place
+};
+
+/*
+ * Backend providing counters to StatConnector and interface names to every
+ * reader of the interface table.
+ * Read and Epoch are only called by one thread at a time, WatchInterfaces
+ * runs on its own thread.
+ */
+class CounterSource {
+  public:
+    virtual ~CounterSource() {}
+
+    /* Read entries matching any of patterns, regexes on their name, in a
+     * single scan. Entries stay valid until next Read.
+     * @return false if no entry matches. */
+    virtual bool Read(const std::vector<std::string>& patterns,
+                      std::vector<CounterEntry>& entries) = 0;
+    /* Directory epoch, changes when entry indexes are reassigned */
+    virtual uint64_t Epoch() = 0;
+
+    /* State of an entry once its counters have been used */
+    enum Validity {
+      VALID,       // counters were not moved meanwhile
+      ENTRY_MOVED, // entry has been read again, use it again
+      STALE        // directory has changed, Read again
+    };
+    /* Check an entry read in place once its counters have been used.
+     * Sources handing out copies of counters always return VALID */
+    virtual Validity Validate(CounterEntry& entry) {return VALID;};
+    /* Thread loop keeping the interface table up to date */
+    virtual void WatchInterfaces() = 0;
+
+    /* Current interface table, safe to call from any thread */
+    static IfTablePtr GetIfTable();
+    /* Replace the interface table */
+    static void PublishIfTable(IfTablePtr table);
+
+  private:
+    //Table of interface names, replaced atomically
+    static IfTablePtr ifTable;
+};
+
+/*
+ * Indexes of the names of a fixed directory matching any of a set of
+ * patterns, resolved once per set. Patterns are chosen by clients, so the
+ * cache is emptied once it holds INDEX_CACHE_SIZE sets.
+ */
+class NameIndexCache {
+  public:
+    /* Indexes of names among size matching any of patterns, valid until
+     * next Lookup. name gives the name at an index */
+    const std::vector<u32>& Lookup(const std::vector<std::string>& patterns,
+        u32 size, const std::function<const std::string&(u32)>& name);
+
+  private:
+    std::map<std::string, std::vector<u32>> indexes;
+};
+
+/* Key and value of each Update built, see FillCounters */
+struct Leaves;
+
+/* Builds gNMI Updates from the counters of a CounterSource. Paths under
+ * TELEMETRY_ROOT are read from the telemetry source instead, if any. Only
+ * the leaves matched by a PathMatcher of the requested paths are built.
+ * Large reads are cut in pieces of entries built in parallel on the
+ * WorkPool, then merged in order. */
 class StatConnector
 {
   public:
-    StatConnector();
-    ~StatConnector();
+    StatConnector(CounterSource& source, CounterSource *telemetry = NULL)
+      : source(source), telemetry(telemetry) {}
+
+    void FillCounters(RepeatedPtrField<Update> *list,
+                      const std::vector<std::string>& metrics,
+                      std::vector<uint64_t> *keys = NULL,
+                      std::vector<uint64_t> *values = NULL,
+                      bool aggregate = false);
+    void FillCounters(RepeatedPtrField<Update> *list, std::string metric,
+                      std::vector<uint64_t> *keys = NULL,
+                      std::vector<uint64_t> *values = NULL,
+                      bool aggregate = false)
+      {FillCounters(list, std::vector<std::string>(1, metric), keys, values,
+                    aggregate);};
+
+  private:
+    typedef std::unordered_map<uint64_t, Path> PathMap;
+
+    /* Cells of an entry selected by Select: a bit per field for each
+     * interface and thread, unless every cell is */
+    struct Cells {
+      bool all = true;
+      std::vector<uint8_t> bits;
+      size_t width = 1;
+
+      /* Tell if field of interface iface and thread k is selected, k is 0
+       * for counters summed over threads */
+      bool Selected(size_t iface, size_t k, int field) const
+        {return all || (bits[iface * width + k] >> field & 1);};
+    };
+
+    /* Leaves of entries[entry] of interfaces [first, last) and threads
+     * [firstThread, lastThread), and the Updates built for them */
+    struct Piece {
+      size_t entry;
+      size_t first, last;
+      size_t firstThread, lastThread;
+      size_t size; // leaves, counting every cell
+      RepeatedPtrField<Update> updates;
+      std::vector<uint64_t> keys, values;
+    };
+
+    const Path& LeafPath(PathMap& paths, uint64_t key, const char *name,
+                         int iface, int thread, const char *field) const;
+    void AddEntry(RepeatedPtrField<Update> *list, const CounterEntry& e,
+                  std::vector<uint64_t> *keys, std::vector<uint64_t> *values,
+                  bool aggregate);
+    void AddLeaves(RepeatedPtrField<Update> *list, const CounterEntry& e,
+                   const Cells& selected, const Piece& piece, Leaves& leaves,
+                   bool aggregate, PathMap& paths) const;
+    const PathMatcher& Matcher(const std::string& path);
+    bool Select(const CounterEntry& entry, bool aggregate, Cells& selected);
+    size_t Split(bool aggregate);
+    bool FillParallel(RepeatedPtrField<Update> *list, size_t fromSource,
+                      Leaves& leaves, bool aggregate);
+
+    CounterSource& source;
+    CounterSource *telemetry;
+    std::vector<CounterEntry> entries; // buffer for source.Read
 
-    void FillCounters(RepeatedPtrField<Update> *list, std::string metric);
+    /* gNMI Path of every leaf already read, by LeafKey. Stale as soon as the
+     * segment epoch or interface table change */
+    PathMap pathCache;
+    uint64_t pathEpoch = 0;
+    IfTablePtr pathIfTable; // interface names used by cached paths
 
-  friend VapiConnector;
+    /* Compiled paths, by UNIX path */
+    std::map<std::string, PathMatcher> matchers;
+    /* Matchers of the current FillCounters call, and states each reached
+     * on the name of the current entry */
+    std::vector<const PathMatcher *> selection;
+    std::vector<PathMatcher::States> states;
+    /* Cells selected in the current entry */
+    Cells cells;
+    /* Cells selected in each entry and pieces of a parallel read */
+    std::vector<Cells> selections;
+    std::deque<Piece> pieces;
 };
 
 //New type for interface events
@@ -42,10 +240,6 @@ class VapiConnector {
   private:
     Connection con;
     bool needUpdate = false;
-    //Map of sw_if_index, interface_name
-    static std::map <u32, std::string> ifMap;
-
-  friend StatConnector;
 };
 
 /* Required to use notify as a non-static callback */
@@ -60,3 +254,59 @@ class Functor {
   private:
     VapiConnector *instance;
 };
+
+/*
+ * CounterSource reading VPP stat segment, interface names from VPP API.
+ * Counters are either copied by stat_segment_dump, or read in place in the
+ * mapped segment: entries then point to the segment, and are checked once
+ * used against the segment epoch and in_progress flag, as VPP stat client
+ * does for its copies.
+ */
+class VppCounterSource : public CounterSource
+{
+  public:
+    VppCounterSource(bool inPlace = false);
+    ~VppCounterSource();
+
+    bool Read(const std::vector<std::string>& patterns,
+              std::vector<CounterEntry>& entries) override;
+    uint64_t Epoch() override;
+    Validity Validate(CounterEntry& entry) override;
+    void WatchInterfaces() override;
+
+  private:
+    u32 * Lookup(const std::vector<std::string>& metrics);
+    void FlushIndexCache();
+    bool ReadEntry(u32 index, CounterEntry& e);
+    bool CopyEntry(CounterEntry& e);
+    void StartAccess();
+
+    /* Stat segment indexes resolved by stat_segment_ls for a set of
+     * patterns, by patterns joined with new lines */
+    struct IndexEntry {
+      u32 *stats; // VPP vector
+      uint64_t epoch;
+    };
+    std::map<std::string, IndexEntry> indexCache;
+
+    stat_segment_data_t *data = NULL; // last dump, freed on next Read
+
+    bool inPlace;
+    /* Access window entries read in place belong to, and its number. An
+     * entry of an older window has to be read again */
+    stat_segment_access_t access;
+    uint64_t window = 0;
+    /* Entry last read again by Validate and how many times in a row. Past
+     * a few times its counters are copied, as VPP moves them faster than
+     * they are used */
+    u32 movedIndex = ~0u;
+    int moves = 0;
+    /* Inconsistent reads of the directory since the last Read not following
+     * a STALE entry. Past a few, counters are dumped instead */
+    int retries = 0;
+    bool staleRead = false;
+    std::deque<std::vector<uint64_t>> copies; // released on next Read
+    VapiConnector vapic;
+};
+
+#endif // GNMI_COLLECTOR_H
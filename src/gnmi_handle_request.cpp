@@ -3,8 +3,10 @@
 #include <iostream>
 #include <memory>
 #include <chrono>
-#include <thread>
 #include <string>
+#include <set>
+#include <map>
+#include <algorithm>
 
 #include <grpc/grpc.h>
 #include <grpcpp/server.h>
@@ -18,37 +20,103 @@ using namespace gnmi;
 using namespace std;
 using namespace chrono;
 using google::protobuf::RepeatedPtrField;
+using google::protobuf::Arena;
+using google::protobuf::ArenaOptions;
 
-/* GnmiToUnixPath - Convert a GNMI Path to UNIX Path
- * @param path the Gnmi Path
+/* Arena blocks grow up to this size, so that a notification of thousands of
+ * counters only takes a few allocations */
+static const size_t ARENA_MAX_BLOCK_SIZE = 1 << 20;
+
+bool RequestHandler::aggregateThreads = false;
+size_t RequestHandler::queueSize = 64;
+RequestHandler::SlowConsumerPolicy RequestHandler::slowConsumerPolicy =
+  RequestHandler::COALESCE;
+
+/* GetSampleKey - Get counters to read for a subscription Path.
+ * The path is relative to the prefix, and takes its origin unless it has
+ * one. Per thread counters are summed when the server runs in aggregation
+ * mode, unless an element has key threads=all. Key threads=sum asks for
+ * sums in any mode, e.g. /if/rx[threads=sum].
+ * @param prefix the prefix of the SubscriptionList or GetRequest.
+ * @param path the Gnmi Path of the Subscription
  */
-string GnmiToUnixPath(Path path)
+SampleKey RequestHandler::GetSampleKey(const Path& prefix, const Path& path)
 {
-  string uxpath;
+  bool aggregate = aggregateThreads;
+  Path full;
 
-  for (int i=0; i < path.elem_size(); i++) {
-    uxpath += "/";
-    uxpath += path.elem(i).name();
+  full.set_origin(path.origin().empty() ? prefix.origin() : path.origin());
+  *full.mutable_elem() = prefix.elem();
+  for (auto& elem : path.elem())
+    *full.add_elem() = elem;
+
+  for (auto& elem : full.elem()) {
+    auto threads = elem.key().find("threads");
+    if (threads != elem.key().end())
+      aggregate = threads->second == "sum";
   }
 
-  return uxpath;
+  return SampleKey(GnmiToUnixPath(full), aggregate);
+}
+
+/* HasBulkKey - Tell if an element of path has key bulk=true, e.g.
+ * /if/rx[bulk=true], asking for the counters of each interface to be packed
+ * in a single Update. It applies to the whole RPC.
+ * @param path the Gnmi Path of a Subscription or prefix.
+ */
+bool RequestHandler::HasBulkKey(const Path& path)
+{
+  for (auto& elem : path.elem()) {
+    auto bulk = elem.key().find("bulk");
+    if (bulk != elem.key().end() && bulk->second == "true")
+      return true;
+  }
+
+  return false;
+}
+
+/* GetSampleKeys - Get counters to read for every path of a SubscriptionList.
+ * @param request the SubscriptionList from SubscribeRequest.
+ * @param keys filled with distinct keys, in order of first subscription.
+ */
+void RequestHandler::GetSampleKeys(const SubscriptionList& request,
+                                   vector<SampleKey>& keys)
+{
+  set<SampleKey> paths;
+
+  for (int i = 0; i < request.subscription_size(); i++) {
+    SampleKey path = GetSampleKey(request.prefix(),
+                                  request.subscription(i).path());
+    if (paths.insert(path).second)
+      keys.push_back(path);
+  }
 }
 
 /**
- * BuildNotification - build a Notification message to answer a SubscribeRequest.
+ * BuildNotification - build the Notification(s) answering a SubscribeRequest.
+ * Only the header of the Notification is serialized for this stream, Updates
+ * are appended as encoded once by their Sample for every stream. Chunks of
+ * Updates are packed in a Notification as long as it stays within the chunk
+ * limits of Samples, further ones go in other Notifications with the same
+ * header, so that a large subscription never needs a single huge message.
  * @param request the SubscriptionList from SubscribeRequest to answer to.
- * @param response the SubscribeResponse that is constructed by this function.
+ * @param samples the Samples of requested paths, shared with other streams.
+ * @param send called with each encoded SubscribeResponse, in order, once it
+ * is complete and before the next one is built.
+ * @param bulk if true, the counters of each interface are packed.
  */
 void RequestHandler::BuildNotification(
-    const SubscriptionList& request, SubscribeResponse& response)
+    const SubscriptionList& request, const vector<SamplePtr>& samples,
+    const function<void(ByteBuffer&)>& send, bool bulk)
 {
+  SubscribeResponse response;
   Notification *notification = response.mutable_update();
-  RepeatedPtrField<Update>* updateList = notification->mutable_update();
-  nanoseconds ts;
+  int64_t ts = 0;
 
-  /* Get time since epoch in milliseconds */
-  ts = duration_cast<nanoseconds>(system_clock::now().time_since_epoch());
-  notification->set_timestamp(ts.count());
+  /* Timestamp of the most recent Sample, in nanoseconds since epoch */
+  for (auto& sample : samples)
+    ts = max(ts, sample->timestamp);
+  notification->set_timestamp(ts);
 
   /* Notification message prefix based on SubscriptionList prefix */
   if (request.has_prefix()) {
@@ -58,165 +126,546 @@ void RequestHandler::BuildNotification(
     prefix->mutable_elem()->Add()->set_name("measurement1");
   }
 
-  // Defined refer to a long Path by a shorter one: alias
-  if (request.use_aliases())
-    cerr << "Unsupported usage of aliases" << endl;
-
-  /* TODO check if only updates should be sent
-   * Require to implement a caching system to access last data sent. */
-  if (request.updates_only())
-    cerr << "Unsupported usage of Updates, every paths will be sent"  << endl;
+  notification->set_atomic(false);
 
   /* Fill Update RepeatedPtrField in Notification message
    * Update field contains only data elements that have changed values. */
-  for (int i = 0; i < request.subscription_size(); i++) {
-    Subscription sub = request.subscription(i);
+  Slice header(response.SerializeAsString());
+  vector<Slice> slices(1, header);
+  size_t updates = 0, bytes = 0;
+  auto flush = [&]() {
+    ByteBuffer buffer(slices.data(), slices.size());
+    send(buffer);
+    slices.assign(1, header);
+    updates = bytes = 0;
+  };
 
-    // Fetch all found counters value for a requested path
-    statc.FillCounters(updateList, GnmiToUnixPath(sub.path()));
+  for (auto& sample : samples) {
+    size_t chunks = sample->Chunks(request.encoding(), bulk);
+    for (size_t c = 0; c < chunks; c++) {
+      const Sample::Chunk& chunk =
+        sample->Serialized(c, request.encoding(), bulk);
+      if (updates > 0 &&
+          ((Sample::maxUpdates && updates + chunk.updates > Sample::maxUpdates)
+           || (Sample::maxBytes && bytes + chunk.slice.size() >
+               Sample::maxBytes)))
+        flush();
+      slices.push_back(chunk.slice);
+      updates += chunk.updates;
+      bytes += chunk.slice.size();
+    }
   }
+  flush();
+}
 
-  notification->set_atomic(false);
+/**
+ * BuildAliasedNotifications - build Notifications whose prefix is an alias.
+ * Updates are grouped by prefix, one Notification per prefix, or more to stay
+ * within the chunk limits of Samples, and carry the remaining relative path
+ * only. A prefix uses the alias defined by the client
+ * if any, otherwise a target-defined alias when the client asked for
+ * use_aliases. A target-defined alias is announced by a Notification holding
+ * the full prefix and the alias, before its first use. Ref: 2.4.2
+ * @param request the SubscriptionList from SubscribeRequest to answer to.
+ * @param samples the Samples of requested paths, shared with other streams.
+ * @param send called with each SubscribeResponse, allocated by NewResponse,
+ * in order, once it is complete and before the next one is built.
+ */
+void RequestHandler::BuildAliasedNotifications(
+    const SubscriptionList& request, const vector<SamplePtr>& samples,
+    const function<void(SubscribeResponse *)>& send)
+{
+  int64_t ts = 0;
+  vector<string> prefixes; // in order of first appearance
+  map<string, vector<const Update *>> updates;
+  map<string, int> prefixLength;
+
+  for (auto& sample : samples) {
+    ts = max(ts, sample->timestamp);
+    for (auto& update : sample->Encoded(request.encoding(), bulk)) {
+      int len = PrefixLength(update.path());
+      string prefix;
+      for (int i = 0; i < len; i++)
+        prefix += "/" + update.path().elem(i).name();
+      auto res = updates.emplace(prefix, vector<const Update *>());
+      if (res.second) {
+        prefixes.push_back(prefix);
+        prefixLength[prefix] = len;
+      }
+      res.first->second.push_back(&update);
+    }
+  }
+
+  for (auto& prefix : prefixes) {
+    const vector<const Update *>& list = updates[prefix];
+    int len = prefixLength[prefix];
+    string alias;
+
+    // Aliases are defined on paths which may have an origin and keys
+    Path full;
+    for (int i = 0; i < len; i++)
+      full.add_elem()->set_name(list.front()->path().elem(i).name());
+    string key = GnmiToPrefix(full);
+
+    auto client = clientAliases.find(key);
+    auto target = targetAliases.find(key);
+    if (client != clientAliases.end()) {
+      alias = client->second;
+    } else if (target != targetAliases.end()) {
+      alias = target->second;
+    } else if (request.use_aliases()) {
+      alias = "#" + to_string(targetAliases.size());
+      targetAliases[key] = alias;
+
+      // Announce alias with the full prefix
+      SubscribeResponse *announce = NewResponse();
+      Notification *notification = announce->mutable_update();
+      notification->set_timestamp(ts);
+      notification->set_alias(alias);
+      Path *path = notification->mutable_prefix();
+      path->set_target(request.prefix().target());
+      *path->mutable_elem() = full.elem();
+      send(announce);
+    }
+
+    // Updates of a prefix are cut in Notifications within chunk limits
+    SubscribeResponse *response = NULL;
+    Notification *notification = NULL;
+    size_t bytes = 0;
+    for (auto update : list) {
+      size_t size = update->ByteSizeLong();
+      if (notification &&
+          ((Sample::maxUpdates && (size_t)notification->update_size() >=
+            Sample::maxUpdates) ||
+           (Sample::maxBytes && bytes + size > Sample::maxBytes))) {
+        send(response);
+        notification = NULL;
+      }
+      if (!notification) {
+        response = NewResponse();
+        notification = response->mutable_update();
+        notification->set_timestamp(ts);
+        notification->set_atomic(false);
+        Path *path = notification->mutable_prefix();
+        path->set_target(request.prefix().target());
+        if (!alias.empty()) {
+          path->add_elem()->set_name(alias);
+        } else {
+          for (int i = 0; i < len; i++)
+            path->add_elem()->set_name(list.front()->path().elem(i).name());
+        }
+        bytes = 0;
+      }
+      Update *relative = notification->add_update();
+      relative->CopyFrom(*update);
+      relative->mutable_path()->mutable_elem()->DeleteSubrange(0, len);
+      bytes += size;
+    }
+    send(response);
+  }
+}
+
+/**
+ * SendNotification - queue the Notification(s) answering a SubscribeRequest.
+ * Updates are sent with full paths in one Notification unless aliases are
+ * in use for this stream, or more when they exceed the chunk limits of
+ * Samples. Each Notification is queued as soon as built, so the first one
+ * is written while the next ones are built.
+ * @param request the SubscriptionList from SubscribeRequest to answer to.
+ * @param samples the Samples of requested paths, shared with other streams.
+ * @param droppable if true, the Notification(s) may be dropped as a whole
+ * by the DROP_OLDEST policy while waiting to be written.
+ */
+void RequestHandler::SendNotification(
+    const SubscriptionList& request, const vector<SamplePtr>& samples,
+    bool droppable)
+{
+  Telemetry::Timer timer(Telemetry::BUILD_NS);
+  uint64_t batch = droppable ? ++batchCount : 0;
+
+  // Samples are accounted once, on the first Notification of the batch
+  const vector<SamplePtr> none;
+  bool first = true;
+  if (!request.use_aliases() && clientAliases.empty()) {
+    BuildNotification(request, samples, [&](ByteBuffer& buffer) {
+      Send(buffer, batch, first ? samples : none);
+      first = false;
+    }, bulk);
+  } else {
+    BuildAliasedNotifications(request, samples,
+                              [&](SubscribeResponse *response) {
+      // Alias announcements are never dropped, later updates rely on them
+      if (response->update().update_size() == 0) {
+        Send(response);
+      } else {
+        Send(response, batch, first ? samples : none);
+        first = false;
+      }
+      // Response has been serialized
+      arena.Reset();
+    });
+  }
+}
+
+/**
+ * Handles AliasList messages by recording aliases defined by the client.
+ * An Alias with an empty path removes the alias. Ref: 2.4.2
+ * @return false if the RPC is closed because of an invalid alias.
+ */
+bool RequestHandler::handleAliases()
+{
+  for (auto& alias : request.aliases().alias()) {
+    if (alias.alias().empty() || alias.alias()[0] != '#') {
+      Close(Status(StatusCode::INVALID_ARGUMENT, grpc::string(
+            "Alias must start with '#'")));
+      return false;
+    }
+
+    for (auto it = clientAliases.begin(); it != clientAliases.end();) {
+      if (it->second == alias.alias())
+        it = clientAliases.erase(it);
+      else
+        ++it;
+    }
+    if (alias.path().elem_size() > 0)
+      clientAliases[GnmiToPrefix(alias.path())] = alias.alias();
+  }
+
+  return true;
 }
 
 /**
  * Handles SubscribeRequest messages with STREAM subscription mode by
  * periodically sending updates to the client.
+ * Sampling is delegated to the shared SamplingEngine which pushes Samples of
+ * due subscriptions to this handler.
  */
-Status RequestHandler::handleStream(
-    ServerContext* context, SubscribeRequest request,
-    ServerReaderWriter<SubscribeResponse, SubscribeRequest>* stream)
+void RequestHandler::handleStream()
 {
+  const SubscriptionList& list = subscription.subscribe();
+
   // Checks that sample_interval values are not higher than
   // std::chrono::duration<long long, std::nano>::max().count() = 9223372036854775807
-  for (int i=0; i<request.subscribe().subscription_size(); i++) {
-    Subscription sub = request.subscribe().subscription(i);
-    if (sub.sample_interval() > duration<long long, std::nano>::max().count()) {
-      context->TryCancel();
-      return Status(StatusCode::INVALID_ARGUMENT, grpc::string(
-        "sample_interval must be less than 9223372036854775807 nanoseconds"));
+  for (int i=0; i<list.subscription_size(); i++) {
+    if (list.subscription(i).sample_interval() >
+        (uint64_t) duration<long long, std::nano>::max().count()) {
+      Close(Status(StatusCode::INVALID_ARGUMENT, grpc::string(
+        "sample_interval must be less than 9223372036854775807 nanoseconds")));
+      return;
     }
   }
 
-  // Sends a first Notification message that updates all Subcriptions
-  SubscribeResponse response;
-  BuildNotification(request.subscribe(), response);
-  stream->Write(response);
-  response.Clear();
+  /* A path is filtered against values already sent only when all of its
+   * Subscriptions allow it: SAMPLE with suppress_redundant, or ON_CHANGE with
+   * a heartbeat_interval (sampled then filtered to honour the heartbeat).
+   * The shortest heartbeat among them is kept. Ref: 3.5.1.5.2 */
+  for (int i=0; i<list.subscription_size(); i++) {
+    const Subscription& sub = list.subscription(i);
+    bool suppress = sub.mode() == SAMPLE ? sub.suppress_redundant()
+                                         : sub.heartbeat_interval() > 0;
+    auto res = filters.emplace(GetSampleKey(list.prefix(), sub.path()),
+                               Filter());
+    Filter& filter = res.first->second;
+    if (res.second)
+      filter.enabled = true;
+    filter.enabled &= suppress;
+    if (sub.heartbeat_interval() > 0 && (filter.heartbeat == 0 ||
+                                         sub.heartbeat_interval() < filter.heartbeat))
+      filter.heartbeat = sub.heartbeat_interval();
+    if (sub.mode() != SAMPLE && sub.heartbeat_interval() == 0)
+      onChange.insert(res.first->first);
+  }
+
+  // The first Notification is sent by SyncStream, once the engine has read
+  // every path
+  vector<SampleKey> keys;
+  GetSampleKeys(list, keys);
+  engine.Sync(keys, this);
+}
+
+/**
+ * SyncStream - Complete the initial synchronization of a STREAM
+ * subscription, then register its Subscriptions to the sampling engine.
+ * @param samples the Samples of the paths of the SubscriptionList.
+ */
+void RequestHandler::SyncStream(const vector<SamplePtr>& samples)
+{
+  const SubscriptionList& list = subscription.subscribe();
+
+  // Sends a first Notification message that updates all Subcriptions,
+  // unless client only wants updates
+  if (!list.updates_only()) {
+    SendNotification(list, samples);
+    for (auto& sample : samples)
+      filters[sample->Key()].cache.Record(sample);
+  }
 
   // Sends a SYNC message that indicates that initial synchronization
   // has completed, i.e. each Subscription has been updated once
+  SubscribeResponse response;
   response.set_sync_response(true);
-  stream->Write(response);
-  response.Clear();
-
-  // We use a vector of pairs instead of a map as we are going to iterate more
-  // than we are going to retrieve specific keys.
-  vector<pair<Subscription, time_point<high_resolution_clock>>> chronomap;
-  for (int i=0; i<request.subscribe().subscription_size(); i++) {
-    Subscription sub = request.subscribe().subscription(i);
-    switch (sub.mode()) {
-      case SAMPLE:
-        chronomap.emplace_back(sub, high_resolution_clock::now());
-        break;
-      default:
-        // TODO: Handle ON_CHANGE and TARGET_DEFINED modes
-        // Ref: 3.5.1.5.2
-        break;
-    }
-  }
+  Send(&response);
 
-  /* Periodically updates paths that require SAMPLE updates
+  /* Registers Subscriptions to the sampling engine
    * Note : There is only one Path per Subscription, but repeated
    * Subscriptions in a SubscriptionList, each Subscription can
-   * have its own sample interval */
-  while(!context->IsCancelled()) {
-    auto start = high_resolution_clock::now();
-
-    SubscribeRequest updateRequest(request);
-    SubscriptionList* updateList(updateRequest.mutable_subscribe());
-    updateList->clear_subscription();
-
-    for (auto& pair : chronomap) {
-      duration<long long, std::nano> duration =
-        high_resolution_clock::now()-pair.second;
-      if (duration > nanoseconds{pair.first.sample_interval()}) {
-        pair.second = high_resolution_clock::now();
-        Subscription* sub = updateList->add_subscription();
-        sub->CopyFrom(pair.first);
-      }
+   * have its own sample interval. ON_CHANGE and TARGET_DEFINED
+   * Subscriptions only receive leaves that changed since the initial
+   * Notification. Ref: 3.5.1.5.2 */
+  map<SampleKey, SamplePtr> initial;
+  for (auto& sample : samples)
+    initial[sample->Key()] = sample;
+
+  for (int i=0; i<list.subscription_size(); i++) {
+    const Subscription& sub = list.subscription(i);
+    SampleKey path = GetSampleKey(list.prefix(), sub.path());
+    if (sub.mode() != SAMPLE && sub.heartbeat_interval() > 0)
+      engine.Subscribe(path, SAMPLE, 0, this);
+    else
+      engine.Subscribe(path, sub.mode(), sub.sample_interval(), this,
+                       initial[path]);
+  }
+
+  // Client may still send AliasList messages
+  StartRead();
+}
+
+/* SuppressRedundant - Remove from a batch leaves already sent to the client,
+ * according to filters of their path.
+ * @param batch Samples pushed by the engine, filtered in place.
+ */
+void RequestHandler::SuppressRedundant(vector<SamplePtr>& batch)
+{
+  vector<SamplePtr> kept;
+
+  for (auto& sample : batch) {
+    auto it = filters.find(sample->Key());
+    if (it == filters.end() || !it->second.enabled) {
+      kept.push_back(sample);
+      continue;
     }
+    SamplePtr filtered = it->second.cache.Filter(sample, it->second.heartbeat);
+    if (filtered)
+      kept.push_back(filtered);
+  }
 
-    if (updateList->subscription_size() > 0) {
-      BuildNotification(updateRequest.subscribe(), response);
-      stream->Write(response);
-      response.Clear();
+  batch.swap(kept);
+}
+
+/**
+ * SendUpdates - Queue a batch of STREAM updates. Once queueSize batches are
+ * waiting to be written, the client is too slow and the slow consumer policy
+ * applies: samples are held and coalesced per path until the queue drains,
+ * the oldest queued updates are dropped, or the RPC is closed.
+ * @param batch Samples pushed by the engine, already filtered.
+ */
+void RequestHandler::SendUpdates(const vector<SamplePtr>& batch)
+{
+  if (held.empty() && !QueueFull()) {
+    SendNotification(subscription.subscribe(), batch, true);
+    return;
+  }
+
+  switch (slowConsumerPolicy) {
+    case COALESCE:
+      // Merged when sent, so a tick only costs a few pointers
+      for (auto& sample : batch) {
+        vector<SamplePtr>& samples = held[sample->Key()];
+        if (!samples.empty())
+          Telemetry::Add(Telemetry::SAMPLES_COALESCED);
+        samples.push_back(sample);
+        if (samples.size() >= queueSize) {
+          SamplePtr merged = Coalesce(samples);
+          samples.assign(1, merged);
+        }
+      }
+      FlushHeld();
+      break;
+    case DROP_OLDEST:
+      if (QueueFull())
+        DropOldest();
+      if (held.empty()) {
+        SendNotification(subscription.subscribe(), batch, true);
+      } else {
+        // Deltas kept from dropped batches go first, merged with this one
+        for (auto& sample : batch)
+          held[sample->Key()].push_back(sample);
+        SendHeld();
+      }
+      break;
+    case DISCONNECT:
+      {
+        lock_guard<mutex> lock(mtx);
+        // Only the write in flight, if any, is completed
+        outgoing.erase(outgoing.begin() + (writing ? 1 : 0), outgoing.end());
+      }
+      Telemetry::Add(Telemetry::STREAMS_DISCONNECTED);
+      Close(Status(StatusCode::RESOURCE_EXHAUSTED, grpc::string(
+            "Subscriber does not keep up with updates")));
+      break;
+  }
+}
+
+/* FlushHeld - Send coalesced samples once the queue has room for them */
+void RequestHandler::FlushHeld()
+{
+  if (held.empty() || QueueFull())
+    return;
+
+  SendHeld();
+}
+
+/* SendHeld - Send held samples, the latest value of each leaf */
+void RequestHandler::SendHeld()
+{
+  vector<SamplePtr> samples;
+  for (auto& entry : held)
+    samples.push_back(Coalesce(entry.second));
+  held.clear();
+  SendNotification(subscription.subscribe(), samples, true);
+}
+
+/* DropOldest - Drop the oldest droppable Notification(s) not being written.
+ * Values of their paths are forgotten by filters, so that suppressed leaves
+ * are sent again in full on the next tick. Deltas of ON_CHANGE paths are
+ * not lost but held, to be merged with the next updates.
+ */
+void RequestHandler::DropOldest()
+{
+  vector<SampleKey> keys;
+  vector<SamplePtr> changes;
+  {
+    lock_guard<mutex> lock(mtx);
+
+    auto first = outgoing.begin() + (writing ? 1 : 0);
+    auto oldest = find_if(first, outgoing.end(),
+                          [](const Outgoing& o) {return o.batch != 0;});
+    if (oldest == outgoing.end())
+      return;
+
+    uint64_t batch = oldest->batch;
+    for (auto it = oldest; it != outgoing.end() && it->batch == batch; ++it) {
+      Telemetry::Add(Telemetry::SAMPLES_DROPPED,
+                     it->samples - it->changes.size());
+      keys.insert(keys.end(), it->keys.begin(), it->keys.end());
+      changes.insert(changes.end(), it->changes.begin(), it->changes.end());
     }
+    outgoing.erase(remove_if(oldest, outgoing.end(),
+                             [batch](const Outgoing& o) {
+                               return o.batch == batch;
+                             }),
+                   outgoing.end());
+  }
 
-    // Caps the loop at 5 iterations per second
-    auto loopTime = high_resolution_clock::now() - start;
-    this_thread::sleep_for(milliseconds(200) - loopTime);
+  for (auto& key : keys) {
+    auto it = filters.find(key);
+    if (it != filters.end())
+      it->second.cache.Clear();
   }
+  for (auto& sample : changes)
+    held[sample->Key()].push_back(sample);
+}
 
-  return Status::OK;
+/* QueueFull - Tell if the responses of queueSize batches are waiting to be
+ * written. A batch takes one slot however many Notifications it is split in,
+ * only its first response carrying its Samples. */
+bool RequestHandler::QueueFull()
+{
+  lock_guard<mutex> lock(mtx);
+  size_t slots = count_if(outgoing.begin(), outgoing.end(),
+                          [](const Outgoing& o) {return o.samples > 0;});
+  return slots >= queueSize;
 }
 
 /**
  * Handles SubscribeRequest messages with ONCE subscription mode by updating
  * all the Subscriptions once, sending a SYNC message, then closing the RPC.
  */
-Status RequestHandler::handleOnce(
-    ServerContext* context, SubscribeRequest request,
-    ServerReaderWriter<SubscribeResponse, SubscribeRequest>* stream)
+void RequestHandler::handleOnce()
 {
-  // Sends a Notification message that updates all Subcriptions once
-  SubscribeResponse response;
-  BuildNotification(request.subscribe(), response);
-  stream->Write(response);
-  response.Clear();
+  // The Notification updating all Subscriptions once is sent by SyncOnce,
+  // once the engine has read every path, unless client only wants updates
+  if (!subscription.subscribe().updates_only()) {
+    vector<SampleKey> keys;
+    GetSampleKeys(subscription.subscribe(), keys);
+    engine.Sync(keys, this);
+  } else {
+    SyncOnce(vector<SamplePtr>());
+  }
+}
+
+/**
+ * SyncOnce - Send the Notification answering a ONCE subscription, then close
+ * the RPC.
+ * @param samples the Samples of the paths of the SubscriptionList, none if
+ * the client only wants updates.
+ */
+void RequestHandler::SyncOnce(const vector<SamplePtr>& samples)
+{
+  if (!subscription.subscribe().updates_only())
+    SendNotification(subscription.subscribe(), samples);
 
   // Sends a message that indicates that initial synchronization
   // has completed, i.e. each Subscription has been updated once
+  SubscribeResponse response;
   response.set_sync_response(true);
-  stream->Write(response);
-  response.Clear();
+  Send(&response);
 
-  context->TryCancel();
-  return Status::OK;
+  Close(Status::OK);
 }
 
 /**
- * Handles SubscribeRequest messages with POLL subscription mode by updating
- * all the Subscriptions each time a Poll request in received.
+ * SendPolled - Send the Notification answering a Poll, once the engine has
+ * read its paths. Once the client is done writing, the RPC is closed after
+ * the last Poll is answered.
+ * @param samples the Samples of the paths of the SubscriptionList.
  */
-Status RequestHandler::handlePoll(
-    ServerContext* context, SubscribeRequest request,
-    ServerReaderWriter<SubscribeResponse, SubscribeRequest>* stream)
+void RequestHandler::SendPolled(const vector<SamplePtr>& samples)
 {
-  SubscribeRequest subscription = request;
-  while (stream->Read(&request)) {
-    switch (request.request_case()) {
-      case request.kPoll:
-        {
-          // Sends a Notification message that updates all Subcriptions once
-          SubscribeResponse response;
-          BuildNotification(subscription.subscribe(), response);
-          stream->Write(response);
-          response.Clear();
+  SendNotification(subscription.subscribe(), samples);
+
+  if (--pollsPending == 0 && readsDone)
+    Close(Status::OK);
+}
+
+/**
+ * Handles SubscribeRequest messages received after the SubscriptionList.
+ * In POLL subscription mode, all the Subscriptions are updated each time a
+ * Poll request in received. Polls are handed over to the engine which
+ * reads paths polled by several streams at once, answers come back in order
+ * through Polled. In every mode, AliasList messages define client aliases.
+ */
+void RequestHandler::handleNextRequest()
+{
+  switch (request.request_case()) {
+    case request.kPoll:
+      {
+        if (subscription.subscribe().mode() != SubscriptionList_Mode_POLL) {
+          Close(Status(StatusCode::INVALID_ARGUMENT, grpc::string(
+                "Poll is only valid for POLL subscription mode")));
           break;
         }
-      case request.kAliases:
-        return Status(StatusCode::UNIMPLEMENTED, grpc::string(
-              "Aliases not implemented yet"));
-      case request.kSubscribe:
-        return Status(StatusCode::INVALID_ARGUMENT, grpc::string(
-              "A SubscriptionList has already been received for this RPC"));
-      default:
-        return Status(StatusCode::INVALID_ARGUMENT, grpc::string(
-              "Unknown content for SubscribeRequest message"));
-    }
+        // The Notification updating all Subscriptions once is sent by
+        // SendPolled
+        vector<SampleKey> keys;
+        GetSampleKeys(subscription.subscribe(), keys);
+        pollsPending++;
+        engine.Poll(keys, this);
+        StartRead();
+        break;
+      }
+    case request.kAliases:
+      if (handleAliases())
+        StartRead();
+      break;
+    case request.kSubscribe:
+      Close(Status(StatusCode::INVALID_ARGUMENT, grpc::string(
+            "A SubscriptionList has already been received for this RPC")));
+      break;
+    default:
+      Close(Status(StatusCode::INVALID_ARGUMENT, grpc::string(
+            "Unknown content for SubscribeRequest message")));
   }
-  return Status::OK;
 }
 
 /**
@@ -224,27 +673,366 @@ Status RequestHandler::handlePoll(
  * If it does not have the "subscribe" field set, the RPC MUST be cancelled.
  * Ref: 3.5.1.1
  */
-Status RequestHandler::handleSubscribeRequest(ServerContext* context,
-    ServerReaderWriter<SubscribeResponse, SubscribeRequest>* stream)
+void RequestHandler::handleSubscribeRequest()
 {
-  SubscribeRequest request;
-  stream->Read(&request);
-  if (!request.has_subscribe()) {
-    context->TryCancel();
-    return Status(StatusCode::INVALID_ARGUMENT, grpc::string(
-          "SubscribeRequest needs non-empty SubscriptionList"));
+  if (!subscription.has_subscribe()) {
+    Close(Status(StatusCode::INVALID_ARGUMENT, grpc::string(
+          "SubscribeRequest needs non-empty SubscriptionList")));
+    return;
+  }
+
+  const SubscriptionList& list = subscription.subscribe();
+  if (list.encoding() != JSON && list.encoding() != JSON_IETF &&
+      list.encoding() != PROTO) {
+    Close(Status(StatusCode::UNIMPLEMENTED, grpc::string(
+          "Supported encodings are JSON, JSON_IETF and PROTO")));
+    return;
   }
 
-  switch (request.subscribe().mode()) {
+  bulk = HasBulkKey(list.prefix());
+  for (auto& sub : list.subscription())
+    bulk |= HasBulkKey(sub.path());
+
+  switch (subscription.subscribe().mode()) {
     case SubscriptionList_Mode_STREAM:
-      return handleStream(context, request, stream);
+      activeStreams = Telemetry::STREAMS_STREAM;
+      Telemetry::Add(activeStreams);
+      handleStream();
+      break;
     case SubscriptionList_Mode_ONCE:
-      return handleOnce(context, request, stream);
+      activeStreams = Telemetry::STREAMS_ONCE;
+      Telemetry::Add(activeStreams);
+      handleOnce();
+      break;
     case SubscriptionList_Mode_POLL:
-      return handlePoll(context, request, stream);
+      activeStreams = Telemetry::STREAMS_POLL;
+      Telemetry::Add(activeStreams);
+      StartRead();
+      break;
     default:
-      return Status(StatusCode::UNKNOWN,
-          grpc::string("Unkown subscription mode"));
+      Close(Status(StatusCode::UNKNOWN,
+          grpc::string("Unkown subscription mode")));
+  }
+}
+
+/* NotificationArenaOptions - Options of the arena of a RequestHandler */
+static ArenaOptions NotificationArenaOptions()
+{
+  ArenaOptions options;
+
+  options.max_block_size = ARENA_MAX_BLOCK_SIZE;
+
+  return options;
+}
+
+/* Register a new handler waiting for the next Subscribe RPC on cq */
+RequestHandler::RequestHandler(AsyncSubscribeService *service,
+    ServerCompletionQueue *cq, SamplingEngine& engine)
+  : service(service), cq(cq), engine(engine), stream(&context),
+    arena(NotificationArenaOptions())
+{
+  for (int i = 0; i < OPERATION_MAX; i++)
+    tags[i] = {this, static_cast<Operation>(i)};
+
+  pending = 2; // CONNECT and DONE
+  context.AsyncNotifyWhenDone(&tags[DONE]);
+  service->RequestSubscribe(&context, &stream, cq, cq, &tags[CONNECT]);
+}
+
+/**
+ * Proceed - Advance the state machine when an operation has completed.
+ * Always called from the completion queue thread of this handler.
+ * @param op the completed operation.
+ * @param ok false if the operation failed, e.g. the stream is broken.
+ */
+void RequestHandler::Proceed(Operation op, bool ok)
+{
+  switch (op) {
+    case CONNECT:
+      if (!ok) { // Server is shutting down, DONE will never come
+        delete this;
+        return;
+      }
+      new RequestHandler(service, cq, engine);
+      StartRead();
+      break;
+    case READ:
+      if (!ok) {
+        // Client is done writing, only POLL mode needs it to go on, until
+        // its last Poll is answered
+        readsDone = true;
+        if (!subscription.has_subscribe())
+          Close(Status(StatusCode::INVALID_ARGUMENT, grpc::string(
+                "SubscribeRequest needs non-empty SubscriptionList")));
+        else if (subscription.subscribe().mode() ==
+                 SubscriptionList_Mode_POLL && pollsPending == 0)
+          Close(Status::OK);
+      } else if (!SerializationTraits<SubscribeRequest>::Deserialize(
+                     &readBuffer, &request).ok()) {
+        Close(Status(StatusCode::INVALID_ARGUMENT, grpc::string(
+              "Can not parse SubscribeRequest")));
+      } else if (subscription.request_case() ==
+                 SubscribeRequest::REQUEST_NOT_SET) {
+        subscription.Swap(&request);
+        handleSubscribeRequest();
+      } else {
+        handleNextRequest();
+      }
+      break;
+    case WRITE:
+      {
+        lock_guard<mutex> lock(mtx);
+        writing = false;
+        Telemetry::Observe(Telemetry::WRITE_NS, duration_cast<nanoseconds>(
+              steady_clock::now() - writeStart).count());
+        if (ok) {
+          outgoing.pop_front();
+          StartWrite();
+        } else {
+          outgoing.clear(); // Stream is broken, DONE will follow
+        }
+      }
+      if (ok)
+        FlushHeld();
+      break;
+    case WAKEUP:
+      {
+        deque<vector<SamplePtr>> ready, answers;
+        {
+          lock_guard<mutex> lock(mtx);
+          wakeupPending = false;
+          ready.swap(batches);
+          answers.swap(polled);
+        }
+        for (auto& samples : answers) {
+          switch (subscription.subscribe().mode()) {
+            case SubscriptionList_Mode_STREAM:
+              SyncStream(samples);
+              break;
+            case SubscriptionList_Mode_ONCE:
+              SyncOnce(samples);
+              break;
+            default:
+              SendPolled(samples);
+          }
+        }
+        for (auto& batch : ready) {
+          SuppressRedundant(batch);
+          if (batch.empty())
+            continue;
+          SendUpdates(batch);
+        }
+        break;
+      }
+    case FINISH:
+      break;
+    case DONE:
+      // Once unsubscribed, the engine can not push anymore
+      engine.Unsubscribe(this);
+      if (activeStreams != Telemetry::COUNTER_MAX)
+        Telemetry::Add(activeStreams, -1);
+      {
+        lock_guard<mutex> lock(mtx);
+        done = true;
+        batches.clear();
+        polled.clear();
+      }
+      break;
+    default:
+      break;
+  }
+
+  unique_lock<mutex> lock(mtx);
+  if (--pending == 0 && done) {
+    lock.unlock();
+    delete this;
+  }
+}
+
+/* Push - Queue Samples from the engine and wake up the completion queue */
+void RequestHandler::Push(vector<SamplePtr> batch)
+{
+  lock_guard<mutex> lock(mtx);
+  if (done)
+    return;
+
+  batches.push_back(move(batch));
+  Wakeup();
+}
+
+/* Polled - Queue the answer of a Poll or Sync and wake up the completion
+ * queue */
+void RequestHandler::Polled(vector<SamplePtr> samples)
+{
+  lock_guard<mutex> lock(mtx);
+  if (done)
+    return;
+
+  polled.push_back(move(samples));
+  Wakeup();
+}
+
+/* Wakeup - Have the completion queue report WAKEUP, unless it is about to */
+void RequestHandler::Wakeup()
+{
+  if (!wakeupPending) {
+    wakeupPending = true;
+    pending++;
+    alarm.Set(cq, gpr_now(GPR_CLOCK_MONOTONIC), &tags[WAKEUP]);
   }
+}
+
+/* NewResponse - Allocate a response on the arena, to be given to Send */
+SubscribeResponse * RequestHandler::NewResponse()
+{
+  return Arena::CreateMessage<SubscribeResponse>(&arena);
+}
+
+/* Send - Serialize and queue a response, see Send(ByteBuffer&) */
+void RequestHandler::Send(const SubscribeResponse *response, uint64_t batch,
+                          const vector<SamplePtr>& samples)
+{
+  ByteBuffer buffer;
+  bool own;
+
+  SerializationTraits<SubscribeResponse>::Serialize(*response, &buffer, &own);
+  Send(buffer, batch, samples);
+}
+
+/* Send - Queue an encoded response, written as soon as previous ones are.
+ * @param buffer the encoded response, taken over by this function.
+ * @param batch the droppable batch of updates it belongs to, 0 if none.
+ * @param samples the Samples it carries, given with the first response of a
+ * batch only, for drop accounting.
+ */
+void RequestHandler::Send(ByteBuffer& buffer, uint64_t batch,
+                          const vector<SamplePtr>& samples)
+{
+  lock_guard<mutex> lock(mtx);
+  if (closing || done)
+    return;
+
+  Telemetry::Add(Telemetry::NOTIFICATIONS_SENT);
+  Telemetry::Add(Telemetry::SERIALIZED_BYTES, buffer.Length());
+  outgoing.emplace_back();
+  outgoing.back().buffer.Swap(&buffer);
+  outgoing.back().batch = batch;
+  outgoing.back().samples = samples.size();
+  if (batch != 0) {
+    for (auto& sample : samples) {
+      outgoing.back().keys.push_back(sample->Key());
+      if (onChange.count(sample->Key()))
+        outgoing.back().changes.push_back(sample);
+    }
+  }
+  Telemetry::Observe(Telemetry::QUEUE_DEPTH, outgoing.size());
+  StartWrite();
+}
+
+/* Close - Finish the RPC with status once queued responses are written */
+void RequestHandler::Close(const Status& status)
+{
+  lock_guard<mutex> lock(mtx);
+  if (closing)
+    return;
+
+  closing = true;
+  this->status = status;
+  StartWrite();
+}
+
+/* StartWrite - Write the oldest queued response, or Finish if closing and
+ * nothing is left to write. At most one write is in flight per stream. */
+void RequestHandler::StartWrite()
+{
+  if (writing || finishing || done)
+    return;
+
+  if (outgoing.empty()) {
+    if (closing) {
+      finishing = true;
+      pending++;
+      stream.Finish(status, &tags[FINISH]);
+    }
+    return;
+  }
+
+  writing = true;
+  pending++;
+  writeStart = steady_clock::now();
+  stream.Write(outgoing.front().buffer, &tags[WRITE]);
+}
+
+/* StartRead - Wait for the next SubscribeRequest */
+void RequestHandler::StartRead()
+{
+  lock_guard<mutex> lock(mtx);
+  pending++;
+  stream.Read(&readBuffer, &tags[READ]);
+}
+
+uint64_t GetHandler::freshness = 0;
+
+/**
+ * Handle - Answer a GetRequest with current values of counters.
+ * Paths are relative to the prefix. Every path is read by a single scan of
+ * the stat segment, one per aggregation mode requested, and the scan is
+ * shared with Get calls of the same paths within the freshness window.
+ * Updates are sent in one Notification. Ref: 3.3
+ * @param engine the sampling engine reading counters.
+ * @param request the GetRequest to answer to.
+ * @param response the GetResponse filled by this function.
+ */
+Status GetHandler::Handle(SamplingEngine& engine, const GetRequest& request,
+                          GetResponse *response)
+{
+  Encoding encoding = request.encoding();
+  if (encoding != JSON && encoding != JSON_IETF && encoding != PROTO)
+    return Status(StatusCode::UNIMPLEMENTED, grpc::string(
+          "Supported encodings are JSON, JSON_IETF and PROTO"));
+  if (request.path_size() == 0)
+    return Status(StatusCode::INVALID_ARGUMENT, grpc::string(
+          "GetRequest needs at least one path"));
+
+  // UNIX paths by aggregation of per thread counters
+  map<bool, vector<string>> paths;
+  bool bulk = RequestHandler::HasBulkKey(request.prefix());
+  for (auto& path : request.path()) {
+    bulk |= RequestHandler::HasBulkKey(path);
+    SampleKey key = RequestHandler::GetSampleKey(request.prefix(), path);
+    paths[key.second].push_back(key.first);
+  }
+
+  Notification *notification = response->add_notification();
+  int64_t ts = 0;
+  for (auto& group : paths) {
+    SamplePtr sample = engine.Snapshot(group.second, group.first, freshness);
+    ts = max(ts, sample->timestamp);
+    for (auto& update : sample->Encoded(encoding, bulk))
+      notification->add_update()->CopyFrom(update);
+  }
+
+  if (notification->update_size() == 0)
+    return Status(StatusCode::NOT_FOUND, grpc::string(
+          "No counter matches requested paths"));
+
+  notification->set_timestamp(ts);
+  if (request.has_prefix())
+    notification->mutable_prefix()->set_target(request.prefix().target());
+
   return Status::OK;
 }
+
+/* HandleRpcs - Serve Subscribe RPCs of a completion queue until shutdown */
+void HandleRpcs(AsyncSubscribeService *service, ServerCompletionQueue *cq,
+                SamplingEngine& engine)
+{
+  void *tag;
+  bool ok;
+
+  new RequestHandler(service, cq, engine);
+  while (cq->Next(&tag, &ok)) {
+    RequestHandler::Tag *t = static_cast<RequestHandler::Tag *>(tag);
+    t->handler->Proceed(t->op, ok);
+  }
+}
@@ -1,31 +1,223 @@
 /*  vim:set softtabstop=2 shiftwidth=2 tabstop=2 expandtab: */
 #include <grpc/grpc.h>
+#include <grpcpp/alarm.h>
+#include <grpcpp/support/byte_buffer.h>
+#include <google/protobuf/arena.h>
 #include "../proto/gnmi.grpc.pb.h"
-#include "gnmi_collector.h"
+#include "gnmi_sampler.h"
+#include "gnmi_telemetry.h"
 
-#include <thread>
+#include <map>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <functional>
 
 using namespace grpc;
 using namespace gnmi;
 
-class RequestHandler {
+/* gNMI service with Subscribe served on completion queues. Messages are
+ * exchanged as raw bytes so that encoded Samples are shared between streams */
+typedef gNMI::WithRawMethod_Subscribe<gNMI::Service> AsyncSubscribeService;
+
+/*
+ * Asynchronous Subscribe RPC state machine.
+ * A RequestHandler is created per RPC and driven by the completion queue
+ * thread it has been registered on: every operation completion is reported
+ * to Proceed. Samples pushed by the engine, and the answers of polls it
+ * serves, are handed over to the completion queue through an Alarm, so no
+ * thread ever sleeps on a stream.
+ * The handler deletes itself once the RPC is done and no operation is pending.
+ */
+class RequestHandler : public SampleSink {
   public:
-    Status handleSubscribeRequest(ServerContext* context,
-      ServerReaderWriter<SubscribeResponse, SubscribeRequest>* stream);
+    RequestHandler(AsyncSubscribeService *service, ServerCompletionQueue *cq,
+                   SamplingEngine& engine);
+
+    /* Operations a completion queue tag can report */
+    enum Operation {
+      CONNECT, // new RPC accepted
+      READ,    // SubscribeRequest received
+      WRITE,   // SubscribeResponse sent
+      WAKEUP,  // Samples pushed or polled by the engine
+      FINISH,  // Status sent
+      DONE,    // RPC completed or cancelled
+      OPERATION_MAX
+    };
+
+    /* Tag given to the completion queue for each operation */
+    struct Tag {
+      RequestHandler *handler;
+      Operation op;
+    };
+
+    void Proceed(Operation op, bool ok);
+    void Push(std::vector<SamplePtr> batch) override;
+    void Polled(std::vector<SamplePtr> samples) override;
+
+    /* Encode the Notification(s) of samples, each handed to send as soon
+     * as built, also used by benchmarks */
+    static void BuildNotification(
+        const SubscriptionList& request, const std::vector<SamplePtr>& samples,
+        const std::function<void(ByteBuffer&)>& send, bool bulk = false);
+
+    /* Counters to read for a subscription Path under prefix */
+    static SampleKey GetSampleKey(const Path& prefix, const Path& path);
+    /* Distinct counters to read for a SubscriptionList, in request order */
+    static void GetSampleKeys(const SubscriptionList& request,
+                              std::vector<SampleKey>& keys);
+    /* Tell if a Path asks for bulk updates with key bulk=true */
+    static bool HasBulkKey(const Path& path);
+
+    /* Sum per thread counters unless a subscription asks otherwise */
+    static void SetAggregateThreads(bool aggregate)
+      {aggregateThreads = aggregate;};
+
+    /* Handling of STREAM subscribers slower than their updates */
+    enum SlowConsumerPolicy {
+      COALESCE,    // hold samples, keep the latest value of each leaf
+      DROP_OLDEST, // drop the oldest queued updates
+      DISCONNECT   // close the RPC with RESOURCE_EXHAUSTED
+    };
+
+    /* Apply policy once size batches wait to be written on a stream */
+    static void SetFlowControl(size_t size, SlowConsumerPolicy policy)
+      {queueSize = size; slowConsumerPolicy = policy;};
+
+  private:
+    void handleSubscribeRequest();
+    void handleNextRequest();
+    bool handleAliases();
+    void handleOnce();
+    void handleStream();
+
+    /* Answers of the engine to Sync and Poll, only used from cq thread */
+    void SyncStream(const std::vector<SamplePtr>& samples);
+    void SyncOnce(const std::vector<SamplePtr>& samples);
+    void SendPolled(const std::vector<SamplePtr>& samples);
+
+    void BuildAliasedNotifications(
+        const SubscriptionList& request, const std::vector<SamplePtr>& samples,
+        const std::function<void(SubscribeResponse *)>& send);
+
+    void SendNotification(const SubscriptionList& request,
+                          const std::vector<SamplePtr>& samples,
+                          bool droppable = false);
+
+    /* Flow control of STREAM updates, only used from cq thread */
+    void SendUpdates(const std::vector<SamplePtr>& batch);
+    void FlushHeld();
+    void SendHeld();
+    void DropOldest();
+    bool QueueFull();
+
+    void SuppressRedundant(std::vector<SamplePtr>& batch);
+
+    /* Helpers to drive asynchronous operations. They lock mtx, except
+     * StartWrite and Wakeup which expect it held */
+    SubscribeResponse * NewResponse();
+    void Send(const SubscribeResponse *response, uint64_t batch = 0,
+              const std::vector<SamplePtr>& samples = {});
+    void Send(ByteBuffer& buffer, uint64_t batch = 0,
+              const std::vector<SamplePtr>& samples = {});
+    void Close(const Status& status);
+    void StartWrite();
+    void StartRead();
+    void Wakeup();
 
   private:
-    Status handlePoll(ServerContext* context, SubscribeRequest request,
-        ServerReaderWriter<SubscribeResponse, SubscribeRequest>* stream);
+    AsyncSubscribeService *service;
+    ServerCompletionQueue *cq;
+    SamplingEngine& engine;
+
+    ServerContext context;
+    ServerAsyncReaderWriter<ByteBuffer, ByteBuffer> stream;
+    ByteBuffer readBuffer;
+    SubscribeRequest subscription; // first request received
+    SubscribeRequest request;      // next requests
+
+    /* suppress_redundant state of a path, only used from cq thread */
+    struct Filter {
+      bool enabled = false;
+      uint64_t heartbeat = 0; // ns, 0 if none
+      SentValueCache cache;
+    };
+    std::map<SampleKey, Filter> filters;
+
+    /* Paths whose updates are deltas of ON_CHANGE groups, never dropped by
+     * DROP_OLDEST. Only used from cq thread */
+    std::set<SampleKey> onChange;
+
+    /* Counters of each interface packed in one Update, see BulkUpdates */
+    bool bulk = false;
+
+    /* Aliases by prefix, as written by GnmiToPrefix, only used from cq
+     * thread */
+    std::map<std::string, std::string> clientAliases;
+    std::map<std::string, std::string> targetAliases;
+
+    static bool aggregateThreads;
+    static size_t queueSize;
+    static SlowConsumerPolicy slowConsumerPolicy;
+
+    /* Samples held back by COALESCE while the queue is full, and number of
+     * droppable batches sent. Only used from cq thread */
+    std::map<SampleKey, std::vector<SamplePtr>> held;
+    uint64_t batchCount = 0;
 
-    Status handleOnce(ServerContext* context, SubscribeRequest request,
-      ServerReaderWriter<SubscribeResponse, SubscribeRequest>* stream);
+    /* Polls not answered yet, and whether the client is done writing. Only
+     * used from cq thread */
+    int pollsPending = 0;
+    bool readsDone = false;
 
-    Status handleStream(ServerContext* context, SubscribeRequest request,
-      ServerReaderWriter<SubscribeResponse, SubscribeRequest>* stream);
+    /* Gauge of active streams this RPC is accounted in, COUNTER_MAX if none */
+    Telemetry::Counter activeStreams = Telemetry::COUNTER_MAX;
 
-    void BuildNotification(const SubscriptionList& request,
-                           SubscribeResponse& response);
+    Tag tags[OPERATION_MAX];
+    Alarm alarm;
+
+    /* Responses being built, reset once they are serialized. Only used from
+     * cq thread */
+    google::protobuf::Arena arena;
+
+    /* Encoded response waiting to be written */
+    struct Outgoing {
+      ByteBuffer buffer;
+      uint64_t batch = 0;  // droppable batch of updates, 0 if not droppable
+      size_t samples = 0;  // Samples carried, counted once per batch
+      /* On the first response of a droppable batch, the paths of its
+       * Samples, and its Samples of onChange paths */
+      std::vector<SampleKey> keys;
+      std::vector<SamplePtr> changes;
+    };
+
+    std::mutex mtx; // protects everything below, Push runs on engine thread
+    std::deque<Outgoing> outgoing;
+    std::deque<std::vector<SamplePtr>> batches;
+    std::deque<std::vector<SamplePtr>> polled;
+    Status status;
+    bool writing = false;
+    std::chrono::steady_clock::time_point writeStart; // of in flight write
+    bool wakeupPending = false;
+    bool closing = false;  // Finish once outgoing is drained
+    bool finishing = false;
+    bool done = false;
+    int pending = 0; // outstanding completion queue operations
+};
+
+/* Get RPC, served from the sampling engine on gRPC synchronous threads */
+class GetHandler {
+  public:
+    static Status Handle(SamplingEngine& engine, const GetRequest& request,
+                         GetResponse *response);
+
+    /* Serve Get from counters read less than ns ago, 0 to always read */
+    static void SetFreshness(uint64_t ns) {freshness = ns;};
 
   private:
-    StatConnector statc;
+    static uint64_t freshness;
 };
+
+/* HandleRpcs - Completion queue loop run by each server thread */
+void HandleRpcs(AsyncSubscribeService *service, ServerCompletionQueue *cq,
+                SamplingEngine& engine);
@@ -0,0 +1,239 @@
+/*  vim:set softtabstop=2 shiftwidth=2 tabstop=2 expandtab: */
+
+#include <map>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "gnmi_path.h"
+#include "gnmi_telemetry.h"
+
+using namespace std;
+
+/* GnmiToUnixPath - Convert a GNMI Path to UNIX Path, keeping its origin and
+ * the keys filtering leaves, e.g. vpp-stats:/if/rx[name=local0].
+ * @param path the Gnmi Path
+ */
+string GnmiToUnixPath(const Path& path)
+{
+  string uxpath;
+
+  if (!path.origin().empty())
+    uxpath = path.origin() + ":";
+
+  for (auto& elem : path.elem()) {
+    uxpath += "/";
+    uxpath += elem.name();
+    // Protobuf maps have no order, paths with the same keys must be equal
+    map<string, string> keys(elem.key().begin(), elem.key().end());
+    for (auto& key : keys) {
+      if (key.first == "threads" || key.first == "bulk")
+        continue;
+      uxpath += "[" + key.first + "=" + key.second + "]";
+    }
+  }
+
+  return uxpath;
+}
+
+/* GnmiToPrefix - Convert a GNMI Path to a prefix to match aliases with,
+ * e.g. vpp-stats:/if/rx/local0.
+ * @param path the Gnmi Path, with or without origin and keys.
+ */
+string GnmiToPrefix(const Path& path)
+{
+  string prefix = path.origin();
+
+  // Telemetry leaves are all under TELEMETRY_ROOT, counters never are
+  if (prefix.empty())
+    prefix = path.elem_size() > 0 && path.elem(0).name() == TELEMETRY_ROOT + 1
+      ? TELEMETRY_ORIGIN : VPP_ORIGIN;
+  prefix += ":";
+
+  for (auto& elem : path.elem())
+    prefix += "/" + elem.name();
+
+  return prefix;
+}
+
+/* PathMatcher - Compile a path.
+ * @param path UNIX path as written by GnmiToUnixPath.
+ */
+PathMatcher::PathMatcher(const string& path)
+{
+  bool valid = true;
+  size_t pos = 0;
+
+  size_t colon = path.find(':');
+  if (colon != string::npos && colon < path.find('/')) {
+    string origin = path.substr(0, colon);
+    vpp = origin == VPP_ORIGIN;
+    telemetry = origin == TELEMETRY_ORIGIN;
+    valid = vpp || telemetry;
+    pos = colon + 1;
+  }
+
+  while (pos < path.size()) {
+    if (path[pos] == '/') {
+      pos++;
+      continue;
+    }
+
+    size_t end = path.find_first_of("/[", pos);
+    if (end == string::npos)
+      end = path.size();
+    Elem elem;
+    elem.name = path.substr(pos, end - pos);
+    elem.kind = elem.name == "*" ? ANY : elem.name == "..." ? ANY_DEPTH
+                                                          : LITERAL;
+    elems.push_back(elem);
+
+    for (pos = end; pos < path.size() && path[pos] == '[';) {
+      size_t close = path.find(']', pos);
+      if (close == string::npos)
+        close = path.size();
+      string key = path.substr(pos + 1, close - pos - 1);
+      pos = close + 1;
+
+      size_t eq = key.find('=');
+      string value = eq == string::npos ? "" : key.substr(eq + 1);
+      key = key.substr(0, eq);
+      if (value == "*")
+        continue;
+
+      char *last;
+      if (key == "name" && (iface.empty() || iface == value)) {
+        iface = value;
+      } else if (key == "thread" && thread < 0 && !value.empty()) {
+        thread = strtol(value.c_str(), &last, 10);
+        valid &= *last == '\0' && thread >= 0;
+      } else {
+        valid = false;
+      }
+    }
+  }
+
+  if (valid && elems.size() < 64)
+    accept = 1ULL << elems.size();
+}
+
+/* Closure - Add positions reached by matching ... with no element */
+PathMatcher::States PathMatcher::Closure(States states) const
+{
+  for (size_t i = 0; i < elems.size(); i++)
+    if ((states >> i & 1) && elems[i].kind == ANY_DEPTH)
+      states |= 1ULL << (i + 1);
+
+  return states;
+}
+
+/* Step - Match one more element of a leaf path.
+ * @param states positions reached by previous elements.
+ * @param elem element name.
+ * @return positions reached, 0 if the leaf cannot match.
+ */
+PathMatcher::States PathMatcher::Step(States states, const string& elem) const
+{
+  // Leaves below a matched path match too
+  States next = states & accept;
+
+  for (size_t i = 0; i < elems.size(); i++) {
+    if (!(states >> i & 1))
+      continue;
+    switch (elems[i].kind) {
+      case LITERAL:
+        if (elems[i].name == elem)
+          next |= 1ULL << (i + 1);
+        break;
+      case ANY:
+        next |= 1ULL << (i + 1);
+        break;
+      case ANY_DEPTH:
+        next |= 1ULL << i;
+        break;
+    }
+  }
+
+  return Closure(next);
+}
+
+/* Match - Match the elements of a counter name.
+ * @param name stat segment or telemetry name, e.g. /if/rx.
+ * @return positions reached, 0 if no leaf of the counter can match.
+ */
+PathMatcher::States PathMatcher::Match(const char *name) const
+{
+  bool own = strncmp(name, TELEMETRY_ROOT "/", strlen(TELEMETRY_ROOT) + 1)
+    == 0;
+  if (!accept || !(own ? telemetry : vpp))
+    return 0;
+
+  States states = Closure(1);
+  string elem;
+  for (const char *c = name; states; c++) {
+    if (*c == '/' || *c == '\0') {
+      if (!elem.empty())
+        states = Step(states, elem);
+      elem.clear();
+      if (*c == '\0')
+        break;
+    } else {
+      elem += *c;
+    }
+  }
+
+  return states;
+}
+
+/* Escape - Quote an element name in a regex, the same way for POSIX basic
+ * regexes of VPP and ECMAScript ones of other sources. */
+static string Escape(const string& name)
+{
+  string re;
+
+  for (char c : name) {
+    if (isalnum((unsigned char)c) || strchr("_- :", c))
+      re += c;
+    else if (strchr("^]\\", c))
+      re += string("\\") + c;
+    else
+      re += string("[") + c + "]";
+  }
+
+  return re;
+}
+
+/* Patterns - Get regexes selecting counters that may hold matching leaves.
+ * Names are matched up to the first wildcard, as a counter name may end
+ * at any element: /if/rx gives ^/if$ and ^/if/rx$ and ^/if/rx/.
+ * @param fromTelemetry if true, regexes on telemetry leaf names.
+ * @param patterns where regexes are appended, unless already there.
+ */
+void PathMatcher::Patterns(bool fromTelemetry,
+                           vector<string>& patterns) const
+{
+  vector<string> res;
+  size_t n = 0;
+
+  if (!accept || !(fromTelemetry ? telemetry : vpp))
+    return;
+  while (n < elems.size() && elems[n].kind == LITERAL)
+    n++;
+  // Telemetry leaves are all under TELEMETRY_ROOT, counters never are
+  if (n > 0 && (elems[0].name == TELEMETRY_ROOT + 1) != fromTelemetry)
+    return;
+
+  string prefix = "^";
+  for (size_t i = 0; i < n; i++) {
+    prefix += "/" + Escape(elems[i].name);
+    res.push_back(prefix + "$");
+  }
+  res.push_back(prefix + "/");
+
+  for (auto& re : res)
+    if (find(patterns.begin(), patterns.end(), re) == patterns.end())
+      patterns.push_back(re);
+}
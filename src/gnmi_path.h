@@ -0,0 +1,83 @@
+/*  vim:set softtabstop=2 shiftwidth=2 tabstop=2 expandtab: */
+
+#ifndef GNMI_PATH_H
+#define GNMI_PATH_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "../proto/gnmi.grpc.pb.h"
+
+using gnmi::Path;
+
+/* Origins of served paths, as advertised by Capabilities: VPP counters and
+ * server telemetry. A path without origin may match both. */
+#define VPP_ORIGIN "vpp-stats"
+#define TELEMETRY_ORIGIN "gnmi-server"
+
+/* Write a Path as text: [origin:]/elem[key=value]/elem, keys sorted.
+ * Keys threads and bulk are options, not part of the path */
+std::string GnmiToUnixPath(const Path& path);
+
+/* Write the origin and element names of a Path: origin:/elem/elem. Paths
+ * without origin get the one of the leaves below them, keys are left out.
+ * Notification prefixes and the paths of aliases are compared this way */
+std::string GnmiToPrefix(const Path& path);
+
+/*
+ * Matcher of counter leaves compiled from a path written by GnmiToUnixPath.
+ * Leaf paths are the stat segment name of a counter, then for per interface
+ * counters the interface name, T<n> unless summed over threads, and packets
+ * or bytes for combined counters.
+ * Element * matches any one element, ... any number of elements, and a path
+ * matches every leaf below it. Keys filter leaves: name=IFNAME on interface,
+ * thread=N on thread, value * matching any. Any other key, or an unknown
+ * origin, matches nothing.
+ * Elements are matched as a set of pattern positions, bit i being set once
+ * the first i elements of the pattern have been matched.
+ */
+class PathMatcher {
+  public:
+    explicit PathMatcher(const std::string& path);
+
+    typedef uint64_t States;
+
+    /* States after the elements of a counter name, 0 if no leaf of the
+     * counter can match */
+    States Match(const char *name) const;
+    /* States after one more element */
+    States Step(States states, const std::string& elem) const;
+    /* Tell if leaves reaching states match, besides key filters */
+    bool Accepts(States states) const {return states & accept;};
+
+    /* Regexes on counter names of the source, or of the telemetry source,
+     * selecting every counter that may hold matching leaves */
+    void Patterns(bool telemetry, std::vector<std::string>& patterns) const;
+
+    /* Key filters, empty and -1 when any */
+    const std::string& Interface() const {return iface;};
+    int Thread() const {return thread;};
+    bool Filters() const {return !iface.empty() || thread >= 0;};
+
+  private:
+    enum Kind {
+      LITERAL, // element name
+      ANY,     // *
+      ANY_DEPTH // ...
+    };
+    struct Elem {
+      Kind kind;
+      std::string name;
+    };
+
+    States Closure(States states) const;
+
+    std::vector<Elem> elems;
+    States accept = 0; // 0 if the path matches nothing
+    bool vpp = true;       // may match counters of the source
+    bool telemetry = true; // may match telemetry leaves
+    std::string iface;
+    int thread = -1;
+};
+
+#endif // GNMI_PATH_H
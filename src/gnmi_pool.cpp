@@ -0,0 +1,133 @@
+/*  vim:set softtabstop=2 shiftwidth=2 tabstop=2 expandtab: */
+
+#include <thread>
+
+#include "gnmi_pool.h"
+
+using namespace std;
+
+/* State - Get the pool, allocated on first use and never freed */
+WorkPool::Shared& WorkPool::State()
+{
+  static Shared *state = new Shared();
+
+  return *state;
+}
+
+/* Start - Create the workers of the pool. Workers are detached and only
+ * end with the process.
+ * @param threads number of workers, 0 to run every task on its caller.
+ */
+void WorkPool::Start(unsigned threads)
+{
+  Shared& state = State();
+
+  for (unsigned i = 0; i < threads; i++)
+    state.workers.emplace_back(new Worker());
+  for (unsigned i = 0; i < threads; i++)
+    thread(Loop, i).detach();
+}
+
+/* Width - Number of threads a Run spreads over, the calling one included */
+unsigned WorkPool::Width()
+{
+  return State().workers.size() + 1;
+}
+
+/* Steal - Take an item, from the front of the queue of worker self, else
+ * from the back of the others.
+ * @param self index of the calling worker, the number of workers for a
+ * thread without queue.
+ * @param item filled with the item taken.
+ * @return false if every queue is empty.
+ */
+bool WorkPool::Steal(size_t self, Item& item)
+{
+  Shared& state = State();
+  size_t n = state.workers.size();
+
+  for (size_t i = 0; i < n; i++) {
+    size_t victim = (self + i) % n;
+    Worker& worker = *state.workers[victim];
+    lock_guard<mutex> lock(worker.mtx);
+    if (worker.items.empty())
+      continue;
+    if (victim == self) {
+      item = worker.items.front();
+      worker.items.pop_front();
+    } else {
+      item = worker.items.back();
+      worker.items.pop_back();
+    }
+    state.queued--;
+    return true;
+  }
+
+  return false;
+}
+
+/* Execute - Run the task of an item and account it in its Job */
+void WorkPool::Execute(Item& item)
+{
+  (*item.task)();
+
+  // The Job belongs to the caller of Run, which returns as soon as it sees
+  // left drop to 0: it is only touched under its lock
+  lock_guard<mutex> lock(item.job->mtx);
+  if (--item.job->left == 0)
+    item.job->done.notify_all();
+}
+
+/* Loop - Thread loop of worker self */
+void WorkPool::Loop(size_t self)
+{
+  Shared& state = State();
+  Item item;
+
+  for (;;) {
+    if (Steal(self, item)) {
+      Execute(item);
+      continue;
+    }
+    unique_lock<mutex> lock(state.idleMtx);
+    state.idle.wait(lock, [&state]() {return state.queued > 0;});
+  }
+}
+
+/**
+ * Run - Run tasks on the pool. The calling thread runs queued tasks too,
+ * possibly of other Runs, until every task of its own is done.
+ * @param tasks the tasks, kept alive by the caller until Run returns.
+ */
+void WorkPool::Run(vector<Task>& tasks)
+{
+  Shared& state = State();
+  size_t n = state.workers.size();
+
+  if (n == 0 || tasks.size() < 2) {
+    for (auto& task : tasks)
+      task();
+    return;
+  }
+
+  Job job;
+  job.left = tasks.size();
+  {
+    // Counted before being queued, so that no worker sees it negative
+    lock_guard<mutex> lock(state.idleMtx);
+    state.queued += tasks.size();
+  }
+  for (size_t i = 0; i < tasks.size(); i++) {
+    Worker& worker = *state.workers[i % n];
+    lock_guard<mutex> lock(worker.mtx);
+    worker.items.push_back({&tasks[i], &job});
+  }
+  state.idle.notify_all();
+
+  Item item;
+  while (job.left > 0 && Steal(n, item))
+    Execute(item);
+
+  unique_lock<mutex> lock(job.mtx);
+  job.done.wait(lock, [&job]() {return job.left == 0;});
+}
@@ -0,0 +1,64 @@
+/*  vim:set softtabstop=2 shiftwidth=2 tabstop=2 expandtab: */
+
+#ifndef GNMI_POOL_H
+#define GNMI_POOL_H
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+/*
+ * Work-stealing pool of threads shared by every collection.
+ * Tasks of a Run are dealt round-robin to the queues of workers. A worker
+ * takes tasks from the front of its own queue and, once empty, steals from
+ * the back of the others. The calling thread steals too while it waits, so a
+ * Run makes progress even when every worker is busy with other Runs.
+ * Without workers, tasks run on the calling thread.
+ */
+class WorkPool {
+  public:
+    typedef std::function<void()> Task;
+
+    /* Start threads workers, once, before any Run */
+    static void Start(unsigned threads);
+    /* Threads running tasks of a Run, the calling one included */
+    static unsigned Width();
+    /* Run every task and return once all are done. Tasks must not throw */
+    static void Run(std::vector<Task>& tasks);
+
+  private:
+    /* Tasks of one Run left to complete */
+    struct Job {
+      std::atomic<size_t> left;
+      std::mutex mtx;
+      std::condition_variable done;
+    };
+    struct Item {
+      Task *task;
+      Job *job;
+    };
+    struct Worker {
+      std::mutex mtx;
+      std::deque<Item> items;
+    };
+
+    /* Never destroyed, as workers outlive static objects */
+    struct Shared {
+      std::vector<std::unique_ptr<Worker>> workers;
+      /* Items queued on any worker, idle workers wait for some */
+      std::atomic<size_t> queued {0};
+      std::mutex idleMtx;
+      std::condition_variable idle;
+    };
+
+    static Shared& State();
+    static void Loop(size_t self);
+    static bool Steal(size_t self, Item& item);
+    static void Execute(Item& item);
+};
+
+#endif // GNMI_POOL_H
@@ -0,0 +1,803 @@
+/*  vim:set softtabstop=2 shiftwidth=2 tabstop=2 expandtab: */
+
+#include <iostream>
+#include <cstdint>
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include "gnmi_sampler.h"
+#include "gnmi_telemetry.h"
+#include "gnmi_pool.h"
+
+using namespace std;
+using namespace chrono;
+using namespace gnmi;
+using google::protobuf::io::ArrayOutputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::internal::WireFormatLite;
+
+/* Lowest sample_interval honoured */
+static const uint64_t MIN_SAMPLE_INTERVAL = 1000000; // 1ms
+/* Interval chosen by the target when a client asks for 0 */
+static const uint64_t DEFAULT_SAMPLE_INTERVAL = 200000000; // 200ms
+/* Maximum number of path sets whose last Snapshot is kept */
+static const size_t SNAPSHOT_CACHE_SIZE = 256;
+/* Updates encoded by one task of the WorkPool */
+static const size_t ENCODE_TASK_UPDATES = 2048;
+
+uint64_t SamplingEngine::pollWindow = 0;
+size_t Sample::maxUpdates = 0;
+size_t Sample::maxBytes = 1 << 20;
+
+/* PrefixLength - Number of elements of the prefix an Update is grouped
+ * under when aliases or bulk updates are in use. Interface counters end with
+ * T<thread> and optionally a field: they are grouped under
+ * <counter>/<interface>. Other counters are grouped under their parent.
+ * @param path the Path of the Update.
+ */
+int PrefixLength(const Path& path)
+{
+  for (int i = path.elem_size() - 1; i > 0; i--) {
+    const string& name = path.elem(i).name();
+    if (name.size() > 1 && name[0] == 'T' &&
+        name.find_first_not_of("0123456789", 1) == string::npos)
+      return i;
+  }
+
+  return max(path.elem_size() - 1, 0);
+}
+
+/* IsLayoutElem - Tell if a path element is a thread or a combined counter
+ * field, i.e. the layout of the counters of one interface */
+static bool IsLayoutElem(const string& name)
+{
+  if (name == "packets" || name == "bytes")
+    return true;
+  return name.size() > 1 && name[0] == 'T' &&
+    name.find_first_not_of("0123456789", 1) == string::npos;
+}
+
+/* JsonValue - JSON encoding of a counter value. 64 bits integers are JSON
+ * strings in JSON_IETF encoding. Ref: RFC 7951 6.1 */
+static string JsonValue(const TypedValue& val, Encoding encoding)
+{
+  string json;
+
+  switch (val.value_case()) {
+    case TypedValue::kIntVal:
+      json = to_string(val.int_val());
+      break;
+    case TypedValue::kUintVal:
+      json = to_string(val.uint_val());
+      break;
+    default:
+      return "null";
+  }
+
+  return encoding == JSON_IETF ? "\"" + json + "\"" : json;
+}
+
+/* EncodeValue - Replace a typed counter value by its JSON or JSON_IETF
+ * encoding. PROTO values are left typed.
+ * @param val the value to encode in place.
+ * @param encoding the encoding requested by the client.
+ */
+void EncodeValue(TypedValue *val, Encoding encoding)
+{
+  if (encoding == JSON)
+    val->set_json_val(JsonValue(*val, encoding));
+  else if (encoding == JSON_IETF)
+    val->set_json_ietf_val(JsonValue(*val, encoding));
+}
+
+/**
+ * BulkUpdates - Pack the counters of each interface in a single Update, to
+ * cut the per Update overhead of large tables. Updates sharing a prefix
+ * (PrefixLength) whose remaining elements are threads and fields become one
+ * Update of that prefix:
+ * - JSON and JSON_IETF: an object of the remaining elements, e.g.
+ *   {"T0": {"packets": "1", "bytes": "64"}, "T1": {...}}
+ * - PROTO: proto_bytes holding a ScalarArray of uint_val, in thread order,
+ *   packets before bytes.
+ * Other Updates, e.g. error counters, are kept one per leaf.
+ * @param updates the Updates of a Sample, typed.
+ * @param encoding the encoding requested by the client.
+ * @param packed where resulting Updates are appended.
+ */
+void BulkUpdates(const RepeatedPtrField<Update>& updates, Encoding encoding,
+                 RepeatedPtrField<Update> *packed)
+{
+  vector<string> prefixes; // in order of first appearance
+  map<string, vector<const Update *>> groups;
+
+  for (auto& update : updates) {
+    int len = PrefixLength(update.path());
+    string prefix;
+    for (int i = 0; i < len; i++)
+      prefix += "/" + update.path().elem(i).name();
+    auto res = groups.emplace(prefix, vector<const Update *>());
+    if (res.second)
+      prefixes.push_back(prefix);
+    res.first->second.push_back(&update);
+  }
+
+  for (auto& prefix : prefixes) {
+    const vector<const Update *>& list = groups[prefix];
+    int len = PrefixLength(list.front()->path());
+    bool layout = true;
+    for (auto update : list) {
+      int size = update->path().elem_size();
+      if (size == len || size > len + 2)
+        layout = false;
+      for (int i = len; layout && i < size; i++)
+        layout = IsLayoutElem(update->path().elem(i).name());
+    }
+
+    if (!layout) {
+      for (auto update : list) {
+        Update *copy = packed->Add();
+        copy->CopyFrom(*update);
+        EncodeValue(copy->mutable_val(), encoding);
+      }
+      continue;
+    }
+
+    Update *bulk = packed->Add();
+    Path *path = bulk->mutable_path();
+    for (int i = 0; i < len; i++)
+      *path->add_elem() = list.front()->path().elem(i);
+
+    uint32_t duplicates = 0;
+    ScalarArray array;
+    string json = "{";
+    string group; // first remaining element of the open nested object
+    for (auto update : list) {
+      duplicates = max(duplicates, update->duplicates());
+      if (encoding == gnmi::PROTO) {
+        array.add_element()->set_uint_val(update->val().uint_val());
+        continue;
+      }
+      const Path& p = update->path();
+      string value = JsonValue(update->val(), encoding);
+      if (p.elem_size() == len + 1) {
+        json += (json.size() > 1 ? ",\"" : "\"") + p.elem(len).name() +
+          "\":" + value;
+        continue;
+      }
+      if (p.elem(len).name() != group) {
+        if (!group.empty())
+          json += "},";
+        group = p.elem(len).name();
+        json += "\"" + group + "\":{";
+      } else {
+        json += ",";
+      }
+      json += "\"" + p.elem(len + 1).name() + "\":" + value;
+    }
+    if (!group.empty())
+      json += "}";
+    json += "}";
+
+    bulk->set_duplicates(duplicates);
+    if (encoding == gnmi::PROTO)
+      bulk->mutable_val()->set_proto_bytes(array.SerializeAsString());
+    else if (encoding == JSON)
+      bulk->mutable_val()->set_json_val(json);
+    else
+      bulk->mutable_val()->set_json_ietf_val(json);
+  }
+}
+
+/* ParallelFor - Run body on ranges [first, last) of [0, n), of at most
+ * ENCODE_TASK_UPDATES elements each, spread over the WorkPool */
+static void ParallelFor(size_t n, const function<void(size_t, size_t)>& body)
+{
+  vector<WorkPool::Task> tasks;
+
+  for (size_t first = 0; first < n; first += ENCODE_TASK_UPDATES) {
+    size_t last = min(n, first + ENCODE_TASK_UPDATES);
+    tasks.push_back([&body, first, last]() {body(first, last);});
+  }
+  WorkPool::Run(tasks);
+}
+
+/* Variant - Index of the encoded forms of a Sample */
+int Sample::Variant(Encoding encoding, bool bulk)
+{
+  int variant = encoding == JSON ? 1 : encoding == JSON_IETF ? 2 : 0;
+  return 2 * variant + (bulk ? 1 : 0);
+}
+
+/* Encoded - Get updates with values in encoding, packed if bulk.
+ * @return updates themselves in PROTO when not packed, otherwise a copy
+ * built on first call, shared by every stream asking for the same form.
+ */
+const RepeatedPtrField<Update>& Sample::Encoded(Encoding encoding,
+                                                bool bulk) const
+{
+  int variant = Variant(encoding, bulk);
+  if (variant == 0)
+    return updates;
+
+  call_once(encodeOnce[variant], [this, encoding, bulk, variant]() {
+    encoded[variant].reset(new RepeatedPtrField<Update>());
+    if (bulk) {
+      BulkUpdates(updates, encoding, encoded[variant].get());
+      return;
+    }
+    // Updates are allocated in order, then filled in parallel
+    RepeatedPtrField<Update>& copies = *encoded[variant];
+    copies.Reserve(updates.size());
+    for (int i = 0; i < updates.size(); i++)
+      copies.Add();
+    ParallelFor(updates.size(), [this, &copies, encoding](size_t first,
+                                                          size_t last) {
+      for (size_t i = first; i < last; i++) {
+        Update *copy = copies.Mutable(i);
+        copy->CopyFrom(updates.Get(i));
+        EncodeValue(copy->mutable_val(), encoding);
+      }
+    });
+  });
+
+  return *encoded[variant];
+}
+
+/* Cut - Cut encoded updates in chunks of at most maxUpdates updates and
+ * maxBytes bytes, unless a single update is larger. Sizes of updates are
+ * computed, and cached by updates, in parallel.
+ * @return the chunks of this form, none of them serialized yet.
+ */
+const Sample::Chunking& Sample::Cut(int variant, Encoding encoding,
+                                    bool bulk) const
+{
+  call_once(cutOnce[variant], [this, encoding, bulk, variant]() {
+    const RepeatedPtrField<Update>& updates = Encoded(encoding, bulk);
+    const uint32_t updateTag = WireFormatLite::MakeTag(
+        Notification::kUpdateFieldNumber,
+        WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+
+    vector<size_t> lens(updates.size());
+    ParallelFor(updates.size(), [&updates, &lens](size_t first, size_t last) {
+      for (size_t i = first; i < last; i++)
+        lens[i] = updates.Get(i).ByteSizeLong();
+    });
+
+    Chunking *chunking = new Chunking();
+    vector<int>& ends = chunking->ends;
+    vector<size_t>& sizes = chunking->sizes;
+    size_t size = 0;
+    for (int i = 0; i < updates.size(); i++) {
+      size_t len = lens[i] + CodedOutputStream::VarintSize32(updateTag) +
+        CodedOutputStream::VarintSize64(lens[i]);
+      size_t count = i - (ends.empty() ? 0 : ends.back());
+      if (count > 0 && ((maxUpdates && count >= maxUpdates) ||
+                        (maxBytes && size + len > maxBytes))) {
+        ends.push_back(i);
+        sizes.push_back(size);
+        size = 0;
+      }
+      size += len;
+    }
+    ends.push_back(updates.size());
+    sizes.push_back(size);
+
+    chunking->serializeOnce.reset(new once_flag[ends.size()]);
+    chunking->chunks.resize(ends.size());
+    chunked[variant].reset(chunking);
+  });
+
+  return *chunked[variant];
+}
+
+/* Chunks - Get the number of chunks encoded updates are cut in.
+ * @param encoding the encoding of values requested by the client.
+ * @param bulk if true, the counters of each interface are packed.
+ */
+size_t Sample::Chunks(Encoding encoding, bool bulk) const
+{
+  return Cut(Variant(encoding, bulk), encoding, bulk).chunks.size();
+}
+
+/* Serialized - Encode a chunk of updates as a SubscribeResponse holding a
+ * Notification with these updates only. Since protobuf merges repeated
+ * occurrences of an embedded message, streams append chunks to their own
+ * encoded header (timestamp, prefix) and write the result without copying
+ * the updates. A chunk is serialized when first asked for, so that a stream
+ * writes the first chunks of a large Sample before the next ones are built.
+ * @param c the index of the chunk, below Chunks().
+ * @param encoding the encoding of values requested by the client.
+ * @param bulk if true, the counters of each interface are packed.
+ * @return the encoded chunk, shared by every stream sending this Sample in
+ * the same form.
+ */
+const Sample::Chunk& Sample::Serialized(size_t c, Encoding encoding,
+                                        bool bulk) const
+{
+  const Chunking& chunking = Cut(Variant(encoding, bulk), encoding, bulk);
+
+  call_once(chunking.serializeOnce[c], [&]() {
+    const RepeatedPtrField<Update>& updates = Encoded(encoding, bulk);
+    const uint32_t updateTag = WireFormatLite::MakeTag(
+        Notification::kUpdateFieldNumber,
+        WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+    const uint32_t notificationTag = WireFormatLite::MakeTag(
+        SubscribeResponse::kUpdateFieldNumber,
+        WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+    int first = c > 0 ? chunking.ends[c - 1] : 0;
+    int last = chunking.ends[c];
+    size_t size = chunking.sizes[c];
+
+    // Offset of each update in the slice, so that ranges of updates are
+    // written in parallel
+    size_t head = CodedOutputStream::VarintSize32(notificationTag) +
+      CodedOutputStream::VarintSize64(size);
+    vector<size_t> offsets(last - first + 1, head);
+    for (int i = first; i < last; i++) {
+      size_t len = updates.Get(i).GetCachedSize();
+      offsets[i - first + 1] = offsets[i - first] + len +
+        CodedOutputStream::VarintSize32(updateTag) +
+        CodedOutputStream::VarintSize64(len);
+    }
+
+    grpc::Slice slice(head + size);
+    uint8_t *data = const_cast<uint8_t *>(slice.begin());
+    {
+      ArrayOutputStream array(data, head);
+      CodedOutputStream out(&array);
+      out.WriteTag(notificationTag);
+      out.WriteVarint64(size);
+    }
+    ParallelFor(last - first, [&](size_t from, size_t to) {
+      ArrayOutputStream array(data + offsets[from],
+                              offsets[to] - offsets[from]);
+      CodedOutputStream out(&array);
+      for (size_t i = first + from; i < first + to; i++) {
+        const Update& update = updates.Get(i);
+        out.WriteTag(updateTag);
+        out.WriteVarint64(update.GetCachedSize());
+        update.SerializeWithCachedSizes(&out);
+      }
+    });
+    chunking.chunks[c] = {slice, (size_t)(last - first)};
+  });
+
+  return chunking.chunks[c];
+}
+
+/* ChangedSince - Filter leaves of a Sample that changed.
+ * @param sample the Sample just read.
+ * @param cache last values of leaves, updated with values of sample.
+ * @return a Sample holding only changed leaves, NULL if none has changed.
+ */
+SamplePtr ChangedSince(const SamplePtr& sample, LastValueCache& cache)
+{
+  shared_ptr<Sample> delta;
+
+  for (size_t i = 0; i < sample->keys.size(); i++) {
+    if (!cache.Changed(sample->keys[i], sample->values[i]))
+      continue;
+    if (!delta) {
+      delta = make_shared<Sample>();
+      delta->path = sample->path;
+      delta->aggregate = sample->aggregate;
+      delta->timestamp = sample->timestamp;
+    }
+    delta->updates.Add()->CopyFrom(sample->updates.Get(i));
+    delta->keys.push_back(sample->keys[i]);
+    delta->values.push_back(sample->values[i]);
+  }
+
+  return delta;
+}
+
+/* Coalesce - Merge Samples of a path held for a slow stream.
+ * Leaves of the newest Sample come first, followed by leaves only found in
+ * older ones, so that no change of a delta Sample is lost. Update.duplicates
+ * of a leaf counts the older values it replaces.
+ * @param samples the Samples held, oldest first.
+ * @return the merged Sample, the only one if there is a single Sample.
+ */
+SamplePtr Coalesce(const vector<SamplePtr>& samples)
+{
+  if (samples.size() == 1)
+    return samples.front();
+
+  // Newest occurrence of each leaf and number of values it replaces
+  struct Leaf {
+    const Sample *sample;
+    size_t slot;
+    uint32_t duplicates;
+  };
+  unordered_map<uint64_t, Leaf> leaves;
+  for (auto& sample : samples)
+    for (size_t i = 0; i < sample->keys.size(); i++) {
+      uint32_t dup = sample->updates.Get(i).duplicates();
+      auto res = leaves.emplace(sample->keys[i],
+                                Leaf {sample.get(), i, dup});
+      if (!res.second)
+        res.first->second = {sample.get(), i,
+                             res.first->second.duplicates + 1 + dup};
+    }
+
+  shared_ptr<Sample> merged = make_shared<Sample>();
+  const SamplePtr& newest = samples.back();
+  merged->path = newest->path;
+  merged->aggregate = newest->aggregate;
+  merged->timestamp = newest->timestamp;
+
+  for (auto it = samples.rbegin(); it != samples.rend(); ++it)
+    for (size_t i = 0; i < (*it)->keys.size(); i++) {
+      auto leaf = leaves.find((*it)->keys[i]);
+      if (leaf == leaves.end())
+        continue; // already merged from a newer Sample
+      Update *update = merged->updates.Add();
+      update->CopyFrom(leaf->second.sample->updates.Get(leaf->second.slot));
+      update->set_duplicates(leaf->second.duplicates);
+      merged->keys.push_back((*it)->keys[i]);
+      merged->values.push_back(leaf->second.sample->values[leaf->second.slot]);
+      leaves.erase(leaf);
+    }
+
+  return merged;
+}
+
+/* Reset - Adopt the leaf layout of sample, nothing is known as sent */
+void SentValueCache::Reset(const SamplePtr& sample)
+{
+  keys = sample->keys;
+  values.assign(keys.size(), 0);
+  sentAt.assign(keys.size(), INT64_MIN);
+}
+
+/* Record - Mark every leaf of sample as sent at sample timestamp */
+void SentValueCache::Record(const SamplePtr& sample)
+{
+  if (keys != sample->keys)
+    Reset(sample);
+
+  values = sample->values;
+  sentAt.assign(keys.size(), sample->timestamp);
+}
+
+/* Filter - Suppress leaves whose value has already been sent.
+ * @param sample the Sample to send.
+ * @param heartbeat if not 0, leaves are sent anyway when they have not been
+ * for heartbeat ns.
+ * @return sample itself if no leaf is suppressed, a Sample with leaves to
+ * send otherwise, NULL if there is none.
+ */
+SamplePtr SentValueCache::Filter(const SamplePtr& sample, uint64_t heartbeat)
+{
+  if (keys != sample->keys)
+    Reset(sample);
+
+  int64_t now = sample->timestamp;
+  vector<size_t> slots;
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (sentAt[i] != INT64_MIN && values[i] == sample->values[i] &&
+        (heartbeat == 0 || (uint64_t)(now - sentAt[i]) < heartbeat))
+      continue;
+    values[i] = sample->values[i];
+    sentAt[i] = now;
+    slots.push_back(i);
+  }
+
+  if (slots.size() == keys.size())
+    return sample;
+  if (slots.empty())
+    return nullptr;
+
+  shared_ptr<Sample> filtered = make_shared<Sample>();
+  filtered->path = sample->path;
+  filtered->aggregate = sample->aggregate;
+  filtered->timestamp = sample->timestamp;
+  for (auto i : slots) {
+    filtered->updates.Add()->CopyFrom(sample->updates.Get(i));
+    filtered->keys.push_back(sample->keys[i]);
+    filtered->values.push_back(sample->values[i]);
+  }
+
+  return filtered;
+}
+
+/* Subscribe - Register sink to receive Samples of a path.
+ * SAMPLE subscriptions receive every leaf each interval ns. ON_CHANGE and
+ * TARGET_DEFINED subscriptions receive changed leaves only, checked at the
+ * default sample interval.
+ * Sinks subscribing the same path with the same aggregation at the same
+ * interval in the same mode share a Group.
+ * @param initial Sample sent to sink at subscription time, used as reference
+ * for changes when a new ON_CHANGE group is created. Joining an existing
+ * one, leaves it read since with another value are pushed to sink.
+ */
+void SamplingEngine::Subscribe(const SampleKey& path, SubscriptionMode mode,
+                               uint64_t interval, SampleSink *sink,
+                               SamplePtr initial)
+{
+  if (mode != SAMPLE) {
+    mode = ON_CHANGE;
+    interval = DEFAULT_SAMPLE_INTERVAL;
+  } else if (interval == 0) {
+    interval = DEFAULT_SAMPLE_INTERVAL;
+  } else if (interval < MIN_SAMPLE_INTERVAL) {
+    interval = MIN_SAMPLE_INTERVAL;
+  }
+
+  lock_guard<mutex> lock(mtx);
+  GroupKey key(path, interval, mode);
+  Group& group = groups[key];
+  if (group.sinks.empty()) {
+    if (mode == ON_CHANGE && initial) {
+      ChangedSince(initial, group.lastValues);
+      group.last = initial;
+    }
+
+    // Align deadline on a multiple of interval so that every group with the
+    // same interval ticks together, whenever it was created.
+    nanoseconds now = steady_clock::now().time_since_epoch();
+    nanoseconds period(interval);
+    group.timer = scheduler.Add(
+        Scheduler::Clock::time_point(((now / period) + 1) * period), period);
+    timers[group.timer] = key;
+    cv.notify_one(); // Deadline may be earlier than the one Run waits for
+  } else if (mode == ON_CHANGE && initial && group.last &&
+             group.last->timestamp > initial->timestamp) {
+    // The group was read after initial, changes it pushed meanwhile are
+    // only sent to sink now
+    LastValueCache seen;
+    ChangedSince(initial, seen);
+    SamplePtr missed = ChangedSince(group.last, seen);
+    if (missed)
+      sink->Push({missed});
+  }
+  group.sinks.insert(sink);
+}
+
+/* Unsubscribe - Remove every registration of sink. Once it returns, the
+ * engine will not push into sink anymore. */
+void SamplingEngine::Unsubscribe(SampleSink *sink)
+{
+  lock_guard<mutex> lock(mtx);
+  auto bySink = [sink](const PendingPoll& p) {return p.first == sink;};
+  polls.erase(remove_if(polls.begin(), polls.end(), bySink), polls.end());
+  syncs.erase(remove_if(syncs.begin(), syncs.end(), bySink), syncs.end());
+  serving.erase(remove_if(serving.begin(), serving.end(), bySink),
+                serving.end());
+  for (auto it = groups.begin(); it != groups.end();) {
+    it->second.sinks.erase(sink);
+    if (it->second.sinks.empty()) {
+      scheduler.Remove(it->second.timer);
+      timers.erase(it->second.timer);
+      it = groups.erase(it);
+    } else
+      ++it;
+  }
+}
+
+/* Poll - Queue a Poll of sink. The first Poll of a round opens the poll
+ * window, every Poll queued until it ends is answered by Run from the same
+ * reads, in the order they arrived.
+ * @param keys paths of the SubscriptionList of the polling stream.
+ * @param sink the stream, answered through Polled.
+ */
+void SamplingEngine::Poll(const vector<SampleKey>& keys, SampleSink *sink)
+{
+  lock_guard<mutex> lock(mtx);
+  if (polls.empty()) {
+    pollDeadline = Scheduler::Clock::now() + nanoseconds(pollWindow);
+    cv.notify_one();
+  }
+  polls.emplace_back(sink, keys);
+}
+
+/* Sync - Queue the read of the initial Notification of sink, answered by Run
+ * without waiting for any poll window.
+ * @param keys paths of the SubscriptionList of the stream.
+ * @param sink the stream, answered through Polled.
+ */
+void SamplingEngine::Sync(const vector<SampleKey>& keys, SampleSink *sink)
+{
+  lock_guard<mutex> lock(mtx);
+  syncs.emplace_back(sink, keys);
+  cv.notify_one();
+}
+
+/* Read - Fill a new Sample of key, collectMtx held */
+SamplePtr SamplingEngine::Read(const SampleKey& key, int64_t timestamp)
+{
+  shared_ptr<Sample> sample = make_shared<Sample>();
+  sample->path = key.first;
+  sample->aggregate = key.second;
+  sample->timestamp = timestamp;
+  statc.FillCounters(&sample->updates, sample->path, &sample->keys,
+                     &sample->values, sample->aggregate);
+
+  return sample;
+}
+
+/* Collect - Read every counter matching path from the stat segment.
+ * @param key UNIX path of requested counters and their aggregation.
+ * @return a new Sample.
+ */
+SamplePtr SamplingEngine::Collect(const SampleKey& key)
+{
+  lock_guard<mutex> lock(collectMtx);
+  return Read(key, duration_cast<nanoseconds>(
+        system_clock::now().time_since_epoch()).count());
+}
+
+/* Snapshot - Read every counter matching any of paths by a single scan of
+ * the stat segment. Callers arriving while a scan is running wait for it and
+ * may then reuse its result, so a burst of Get is served by one scan.
+ * @param paths UNIX paths of requested counters.
+ * @param aggregate if true, per interface counters are summed over threads.
+ * @param maxAge if not 0, the last Snapshot of the same paths is returned
+ * when taken less than maxAge ns ago.
+ * @return the Snapshot, a Sample holding leaves of every path.
+ */
+SamplePtr SamplingEngine::Snapshot(const vector<string>& paths, bool aggregate,
+                                   uint64_t maxAge)
+{
+  string joined;
+  for (auto& path : paths)
+    joined += (joined.empty() ? "" : ",") + path;
+  SampleKey key(joined, aggregate);
+
+  lock_guard<mutex> lock(collectMtx);
+  int64_t now =
+    duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  auto it = snapshots.find(key);
+  if (maxAge > 0 && it != snapshots.end() &&
+      (uint64_t)(now - it->second->timestamp) < maxAge)
+    return it->second;
+
+  shared_ptr<Sample> sample = make_shared<Sample>();
+  sample->path = joined;
+  sample->aggregate = aggregate;
+  sample->timestamp = now;
+  statc.FillCounters(&sample->updates, paths, &sample->keys, &sample->values,
+                     aggregate);
+
+  if (maxAge > 0) {
+    if (snapshots.size() >= SNAPSHOT_CACHE_SIZE)
+      snapshots.clear();
+    snapshots[key] = sample;
+  }
+
+  return sample;
+}
+
+/* ServePolls - Answer the polls of a round. Paths polled by several streams
+ * are read once, every Sample of the round having the same timestamp, and
+ * each poll gets the Samples of its own paths in its order.
+ * @param lock the lock of mtx, held by the caller, released while reading.
+ */
+void SamplingEngine::ServePolls(unique_lock<mutex>& lock)
+{
+  serving.swap(polls);
+  pollDeadline = Scheduler::Clock::time_point::max();
+  Telemetry::Add(Telemetry::POLLS_SHARED, Answer(lock));
+}
+
+/* ServeSyncs - Answer the Syncs queued so far, like a round of polls */
+void SamplingEngine::ServeSyncs(unique_lock<mutex>& lock)
+{
+  serving.swap(syncs);
+  Answer(lock);
+}
+
+/* Answer - Read once every path of serving and answer each of its sinks
+ * through Polled.
+ * @param lock the lock of mtx, held by the caller, released while reading.
+ * @return the number of reads saved by sharing paths between sinks.
+ */
+size_t SamplingEngine::Answer(unique_lock<mutex>& lock)
+{
+  set<SampleKey> paths;
+  size_t requested = 0;
+  for (auto& poll : serving) {
+    paths.insert(poll.second.begin(), poll.second.end());
+    requested += poll.second.size();
+  }
+
+  lock.unlock();
+  map<SampleKey, SamplePtr> samples;
+  {
+    lock_guard<mutex> collect(collectMtx);
+    int64_t now = duration_cast<nanoseconds>(
+        system_clock::now().time_since_epoch()).count();
+    for (auto& path : paths)
+      samples[path] = Read(path, now);
+  }
+  lock.lock();
+
+  // Sinks may have been unsubscribed meanwhile
+  for (auto& poll : serving) {
+    vector<SamplePtr> answer;
+    for (auto& key : poll.second)
+      answer.push_back(samples[key]);
+    poll.first->Polled(move(answer));
+  }
+  serving.clear();
+
+  return requested - paths.size();
+}
+
+/* Run - Sleep until the earliest group deadline, read once every unique path
+ * due and fan out Samples to subscribed sinks. Sinks subscribed to several
+ * due groups receive all their Samples in a single batch. Polls are answered
+ * once their window ends, Syncs right away. */
+void SamplingEngine::Run()
+{
+  unique_lock<mutex> lock(mtx);
+
+  while (!stopped) {
+    if (!syncs.empty()) {
+      ServeSyncs(lock);
+      continue;
+    }
+
+    Scheduler::Clock::time_point next = min(scheduler.Next(), pollDeadline);
+    if (next == Scheduler::Clock::time_point::max()) {
+      cv.wait(lock);
+      continue;
+    }
+    if (cv.wait_until(lock, next) != cv_status::timeout &&
+        Scheduler::Clock::now() < next)
+      continue; // Woken by a new subscription, a Poll, a Sync or Stop
+
+    if (pollDeadline <= Scheduler::Clock::now()) {
+      ServePolls(lock);
+      continue;
+    }
+
+    vector<Scheduler::TimerId> expired;
+    scheduler.PopDue(Scheduler::Clock::now(), expired);
+    vector<GroupKey> due;
+    set<SampleKey> paths;
+    for (auto id : expired) {
+      due.push_back(timers[id]);
+      paths.insert(get<0>(timers[id]));
+    }
+
+    // Scan the stat segment without blocking Subscribe/Unsubscribe
+    lock.unlock();
+    map<SampleKey, SamplePtr> samples;
+    for (auto& path : paths)
+      samples[path] = Collect(path);
+    lock.lock();
+
+    // Groups may have been unsubscribed meanwhile
+    map<SampleSink *, vector<SamplePtr>> batches;
+    for (auto& key : due) {
+      auto g = groups.find(key);
+      if (g == groups.end())
+        continue;
+      SamplePtr sample = samples[get<0>(key)];
+      if (get<2>(key) == ON_CHANGE) {
+        g->second.last = sample;
+        sample = ChangedSince(sample, g->second.lastValues);
+        if (!sample)
+          continue;
+      }
+      for (auto sink : g->second.sinks) {
+        vector<SamplePtr>& batch = batches[sink];
+        if (find(batch.begin(), batch.end(), sample) == batch.end())
+          batch.push_back(sample);
+      }
+    }
+    for (auto& b : batches)
+      b.first->Push(move(b.second));
+  }
+}
+
+/* Stop - Ask Run loop to return */
+void SamplingEngine::Stop()
+{
+  lock_guard<mutex> lock(mtx);
+  stopped = true;
+  cv.notify_all();
+}
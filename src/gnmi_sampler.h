@@ -0,0 +1,220 @@
+/*  vim:set softtabstop=2 shiftwidth=2 tabstop=2 expandtab: */
+
+#ifndef GNMI_SAMPLER_H
+#define GNMI_SAMPLER_H
+
+#include <map>
+#include <set>
+#include <tuple>
+#include <mutex>
+#include <memory>
+#include <chrono>
+#include <condition_variable>
+#include <grpcpp/support/slice.h>
+
+#include "gnmi_collector.h"
+#include "gnmi_scheduler.h"
+
+using gnmi::SubscriptionMode;
+using gnmi::Encoding;
+using gnmi::TypedValue;
+
+/* Identity of the counters read by a Sample: UNIX path, and whether per
+ * interface counters are summed over threads */
+typedef std::pair<std::string, bool> SampleKey;
+
+/* Sample - Values of every counter matching one UNIX path, read by a single
+ * stat segment scan. A Sample is immutable once published and is shared by
+ * every stream subscribed to that path. */
+struct Sample {
+  std::string path; // comma separated paths for a Snapshot
+  bool aggregate; // counters summed over threads
+  int64_t timestamp; // nanoseconds since Epoch
+  RepeatedPtrField<Update> updates;
+  std::vector<uint64_t> keys;   // LeafKey of each Update
+  std::vector<uint64_t> values; // value of each Update
+
+  SampleKey Key() const {return SampleKey(path, aggregate);};
+  /* Updates with values in encoding, packed by BulkUpdates if bulk. Built
+   * on first call only, PROTO updates that are not packed are updates */
+  const RepeatedPtrField<Update>& Encoded(Encoding encoding, bool bulk) const;
+
+  /* Encoded updates of a SubscribeResponse within the chunk limits */
+  struct Chunk {
+    grpc::Slice slice;
+    size_t updates;
+  };
+  /* Number of chunks of at most maxUpdates updates and maxBytes bytes the
+   * encoded updates are cut in, on first call only */
+  size_t Chunks(Encoding encoding = gnmi::PROTO, bool bulk = false) const;
+  /* Chunk c of encoded updates as a SubscribeResponse, serialized on first
+   * call only */
+  const Chunk& Serialized(size_t c, Encoding encoding = gnmi::PROTO,
+                          bool bulk = false) const;
+
+  /* Bound the Notifications sent to streams, 0 for no bound */
+  static void SetChunkLimits(size_t updates, size_t bytes)
+    {maxUpdates = updates; maxBytes = bytes;};
+  static size_t maxUpdates;
+  static size_t maxBytes;
+
+  private:
+    // PROTO, JSON and JSON_IETF, each packed or not
+    static const int VARIANTS = 6;
+    static int Variant(Encoding encoding, bool bulk);
+
+    mutable std::once_flag encodeOnce[VARIANTS];
+    mutable std::unique_ptr<RepeatedPtrField<Update>> encoded[VARIANTS];
+    /* Chunks of an encoded form, each serialized once first asked */
+    struct Chunking {
+      std::vector<int> ends;     // end of the updates of each chunk
+      std::vector<size_t> sizes; // encoded size of these updates
+      std::unique_ptr<std::once_flag[]> serializeOnce;
+      mutable std::vector<Chunk> chunks;
+    };
+    const Chunking& Cut(int variant, Encoding encoding, bool bulk) const;
+
+    mutable std::once_flag cutOnce[VARIANTS];
+    mutable std::unique_ptr<Chunking> chunked[VARIANTS];
+};
+
+typedef std::shared_ptr<const Sample> SamplePtr;
+
+/* Number of elements of the prefix an Update is grouped under */
+int PrefixLength(const Path& path);
+/* Replace a typed counter value by its encoding, if not PROTO */
+void EncodeValue(TypedValue *val, Encoding encoding);
+/* Pack updates of each interface counter in one Update per interface */
+void BulkUpdates(const RepeatedPtrField<Update>& updates, Encoding encoding,
+                 RepeatedPtrField<Update> *packed);
+
+/* Part of sample whose leaves changed since last recorded in cache */
+SamplePtr ChangedSince(const SamplePtr& sample, LastValueCache& cache);
+/* Leaves of Samples of a path, oldest first, with the newest value of each */
+SamplePtr Coalesce(const std::vector<SamplePtr>& samples);
+
+/*
+ * Values last sent to one stream for the leaves of one path, used to suppress
+ * redundant updates. Leaves are stored in flat arrays indexed by their slot,
+ * i.e. their position in the Sample, which stays the same as long as the
+ * directory and interface table do not change. When the leaf layout of a
+ * Sample differs, the cache is reset and every leaf is sent again.
+ */
+class SentValueCache {
+  public:
+    /* Leaves of sample to send, NULL if every leaf is suppressed */
+    SamplePtr Filter(const SamplePtr& sample, uint64_t heartbeat);
+    /* Record sample as sent in full */
+    void Record(const SamplePtr& sample);
+    /* Forget values sent, every leaf is sent again */
+    void Clear() {keys.clear(); values.clear(); sentAt.clear();};
+
+  private:
+    void Reset(const SamplePtr& sample);
+
+    std::vector<uint64_t> keys;
+    std::vector<uint64_t> values;
+    std::vector<int64_t> sentAt; // timestamp of last value sent
+};
+
+/* SampleSink - Receiver of a Subscribe stream. Samples due on the same tick
+ * are pushed as a single batch so that they end up in one Notification.
+ * Polled gets the Samples answering one Poll or Sync, in the order of its
+ * paths. Both are called from the sampling engine thread and must not
+ * block. */
+class SampleSink {
+  public:
+    virtual ~SampleSink() {}
+    virtual void Push(std::vector<SamplePtr> batch) = 0;
+    virtual void Polled(std::vector<SamplePtr> samples) = 0;
+};
+
+/*
+ * Central sampling engine shared by every Subscribe stream.
+ * Subscriptions are grouped by (SampleKey, sample_interval, mode) and each group
+ * owns a periodic timer of a Scheduler shared by all streams. Group deadlines
+ * are aligned on multiples of their interval so that overlapping subscribers
+ * from different streams fire on the same tick. On each tick the stat segment
+ * is read once per unique path and the resulting Sample is fanned out to
+ * every subscribed sink.
+ * ON_CHANGE groups poll the segment at the default sample interval and keep
+ * the last value of each leaf: only leaves that changed are pushed, and
+ * nothing at all when no leaf did.
+ * Polls are served by the same thread: polls arriving within the poll window
+ * of the first one are answered together, each distinct path being read
+ * once for all of them. Syncs, the reads of the initial Notification of
+ * STREAM and ONCE subscriptions, are served likewise without waiting, so that
+ * no stream reads the stat segment from the completion queue thread.
+ */
+class SamplingEngine {
+  public:
+    SamplingEngine(StatConnector& statc) : statc(statc) {}
+
+    /* Register sink for periodic (SAMPLE) or delta (ON_CHANGE) Samples of
+     * key. initial is the Sample already sent to sink, if any. */
+    void Subscribe(const SampleKey& key, SubscriptionMode mode,
+                   uint64_t interval, SampleSink *sink,
+                   SamplePtr initial = nullptr);
+    /* Remove every registration and pending poll of sink */
+    void Unsubscribe(SampleSink *sink);
+    /* Read keys for sink on behalf of a Poll, answered through Polled */
+    void Poll(const std::vector<SampleKey>& keys, SampleSink *sink);
+    /* Read keys for sink as soon as possible, answered through Polled */
+    void Sync(const std::vector<SampleKey>& keys, SampleSink *sink);
+    /* Read key right now, out of any tick */
+    SamplePtr Collect(const SampleKey& key);
+    /* Read several paths by a single scan, or reuse the last Snapshot of the
+     * same paths if it is less than maxAge ns old (Get) */
+    SamplePtr Snapshot(const std::vector<std::string>& paths, bool aggregate,
+                       uint64_t maxAge);
+
+    /* Thread loop in charge of ticking groups */
+    void Run();
+    void Stop();
+
+    /* Wait up to ns for other polls before reading polled paths */
+    static void SetPollWindow(uint64_t ns) {pollWindow = ns;};
+
+  private:
+    // path and aggregation, interval, mode
+    typedef std::tuple<SampleKey, uint64_t, SubscriptionMode> GroupKey;
+
+    struct Group {
+      Scheduler::TimerId timer;
+      std::multiset<SampleSink *> sinks;
+      LastValueCache lastValues; // ON_CHANGE only
+      SamplePtr last; // ON_CHANGE only, latest Sample read in full
+    };
+
+    // sink and paths of a Poll
+    typedef std::pair<SampleSink *, std::vector<SampleKey>> PendingPoll;
+
+    SamplePtr Read(const SampleKey& key, int64_t timestamp);
+    void ServePolls(std::unique_lock<std::mutex>& lock);
+    void ServeSyncs(std::unique_lock<std::mutex>& lock);
+    size_t Answer(std::unique_lock<std::mutex>& lock);
+
+    StatConnector& statc;
+    std::mutex collectMtx; // StatConnector is not thread safe
+    std::map<SampleKey, SamplePtr> snapshots; // protected by collectMtx
+
+    std::mutex mtx; // protects groups, timers, scheduler, stopped, polls
+                    // and syncs
+    std::condition_variable cv;
+    std::map<GroupKey, Group> groups;
+    std::map<Scheduler::TimerId, GroupKey> timers;
+    Scheduler scheduler;
+    bool stopped = false;
+
+    /* Polls waiting for the window to end, Syncs waiting for Run, and the
+     * ones being answered */
+    std::vector<PendingPoll> polls;
+    std::vector<PendingPoll> syncs;
+    std::vector<PendingPoll> serving;
+    Scheduler::Clock::time_point pollDeadline =
+      Scheduler::Clock::time_point::max();
+
+    static uint64_t pollWindow;
+};
+
+#endif // GNMI_SAMPLER_H
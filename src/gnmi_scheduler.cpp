@@ -0,0 +1,80 @@
+/*  vim:set softtabstop=2 shiftwidth=2 tabstop=2 expandtab: */
+
+#include "gnmi_scheduler.h"
+
+using namespace std;
+
+/* Add - Arm a new periodic timer.
+ * @param first first deadline.
+ * @param period interval between two deadlines, must be positive.
+ * @return identifier of the timer.
+ */
+Scheduler::TimerId Scheduler::Add(Clock::time_point first,
+                                  Clock::duration period)
+{
+  TimerId id = ++lastId;
+
+  periods[id] = period;
+  heap.push({first, id});
+
+  return id;
+}
+
+/* Remove - Disarm a timer, its heap entry is dropped later */
+void Scheduler::Remove(TimerId id)
+{
+  periods.erase(id);
+  if (heap.size() > 2 * periods.size() + 64)
+    Compact();
+}
+
+/* Compact - Rebuild the heap without entries of removed timers */
+void Scheduler::Compact()
+{
+  vector<Entry> live;
+
+  while (!heap.empty()) {
+    if (periods.count(heap.top().id))
+      live.push_back(heap.top());
+    heap.pop();
+  }
+  for (auto& entry : live)
+    heap.push(entry);
+}
+
+/* Next - Get the earliest deadline among live timers */
+Scheduler::Clock::time_point Scheduler::Next()
+{
+  while (!heap.empty() && !periods.count(heap.top().id))
+    heap.pop();
+
+  if (heap.empty())
+    return Clock::time_point::max();
+
+  return heap.top().deadline;
+}
+
+/* PopDue - Collect timers whose deadline is not after now.
+ * When a timer has missed several deadlines, e.g. because collection took
+ * longer than its period, it fires once and skips to its next deadline in the
+ * future, keeping its phase.
+ * @param now current time.
+ * @param due vector where identifiers of expired timers are appended.
+ */
+void Scheduler::PopDue(Clock::time_point now, vector<TimerId>& due)
+{
+  while (!heap.empty() && heap.top().deadline <= now) {
+    Entry entry = heap.top();
+    heap.pop();
+
+    auto it = periods.find(entry.id);
+    if (it == periods.end())
+      continue;
+
+    due.push_back(entry.id);
+    entry.deadline += it->second;
+    if (entry.deadline <= now)
+      entry.deadline += ((now - entry.deadline) / it->second + 1) * it->second;
+    heap.push(entry);
+  }
+}
@@ -0,0 +1,48 @@
+/*  vim:set softtabstop=2 shiftwidth=2 tabstop=2 expandtab: */
+
+#ifndef GNMI_SCHEDULER_H
+#define GNMI_SCHEDULER_H
+
+#include <queue>
+#include <vector>
+#include <chrono>
+#include <unordered_map>
+
+/*
+ * Deadline scheduler of periodic timers backed by a min-heap.
+ * The owner sleeps until Next() and collects expired timers with PopDue().
+ * Timers are rearmed by adding their period to the previous deadline, not to
+ * the wake up time, so cadence does not drift with scheduling latency.
+ * Removed timers are dropped lazily when they reach the top of the heap.
+ * Not thread safe, callers serialize access.
+ */
+class Scheduler {
+  public:
+    typedef std::chrono::steady_clock Clock;
+    typedef uint64_t TimerId;
+
+    /* Add a timer firing at first, then every period */
+    TimerId Add(Clock::time_point first, Clock::duration period);
+    void Remove(TimerId id);
+
+    /* Earliest deadline, Clock::time_point::max() if there is none */
+    Clock::time_point Next();
+    /* Append expired timers to due and rearm them */
+    void PopDue(Clock::time_point now, std::vector<TimerId>& due);
+
+  private:
+    struct Entry {
+      Clock::time_point deadline;
+      TimerId id;
+      bool operator>(const Entry& other) const
+        {return deadline > other.deadline;};
+    };
+
+    void Compact();
+
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap;
+    std::unordered_map<TimerId, Clock::duration> periods; // live timers
+    TimerId lastId = 0;
+};
+
+#endif // GNMI_SCHEDULER_H
@@ -7,46 +7,47 @@
 using std::string;
 using std::shared_ptr;
 
-/* GetFileContent - Get an entier File content
+/* CheckFile - Exit if a file can not be read
  * @param Path to the file
- * @return String containing the entire File.
  */
-std::string GetFileContent(std::string path)
+static void CheckFile(std::string path)
 {
   std::ifstream ifs(path);
   if (!ifs) {
-    std::cerr << "File" << path << " not found" << std::endl;
+    std::cerr << "File " << path << " not found" << std::endl;
     exit(1);
   }
-
-  std::string content((std::istreambuf_iterator<char>(ifs)),
-      (std::istreambuf_iterator<char>()));
-
-  ifs.close();
-
-  return content;
 }
 
-/* SslCredentialsHelper -
+/* SslCredentialsHelper - Key and certificates are read by a watcher that
+ * reloads them whenever they change, so that they can be rotated without
+ * restarting the server. New handshakes use the new ones, established
+ * connections are kept.
  * @param ppath Private Key path
  * @param cpath certificates path
+ * @param rpath root certificates verifying clients, empty for none
+ * @param refresh seconds between checks of the files
  * @return
  */
 std::shared_ptr<ServerCredentials>
-SslCredentialsHelper(string ppath, string cpath)
+SslCredentialsHelper(string ppath, string cpath, string rpath,
+                     unsigned int refresh)
 {
-  SslServerCredentialsOptions
-        ssl_opts(GRPC_SSL_REQUEST_AND_REQUIRE_CLIENT_CERTIFICATE_AND_VERIFY);
-
-  SslServerCredentialsOptions::PemKeyCertPair pkcp = {
-    GetFileContent(ppath),
-    GetFileContent(cpath)
-  };
-
-  ssl_opts.pem_root_certs = "";
-  ssl_opts.pem_key_cert_pairs.push_back(pkcp);
-
-  return grpc::SslServerCredentials(ssl_opts);
+  CheckFile(ppath);
+  CheckFile(cpath);
+  if (!rpath.empty())
+    CheckFile(rpath);
+
+  auto provider = std::make_shared<FileWatcherCertificateProvider>(
+      ppath, cpath, rpath, refresh);
+  TlsServerCredentialsOptions tls_opts(provider);
+  tls_opts.watch_identity_key_cert_pairs();
+  if (!rpath.empty())
+    tls_opts.watch_root_certs();
+  tls_opts.set_cert_request_type(
+      GRPC_SSL_REQUEST_AND_REQUIRE_CLIENT_CERTIFICATE_AND_VERIFY);
+
+  return grpc::experimental::TlsServerCredentials(tls_opts);
 }
 
 /* Get Server Credentials according to Scurity Context policy */
@@ -55,7 +56,8 @@ std::shared_ptr<ServerCredentials> ServerSecurityContext::GetCredentials()
   std::shared_ptr<ServerCredentials> servCred;
 
   if (encType == SSL) {
-      servCred = SslCredentialsHelper(private_key_path, chain_certs_path);
+      servCred = SslCredentialsHelper(private_key_path, chain_certs_path,
+                                      client_ca_path, cert_refresh);
     } else if (encType == INSECURE) {
         servCred = grpc::InsecureServerCredentials();
     } else {
@@ -66,6 +68,10 @@ std::shared_ptr<ServerCredentials> ServerSecurityContext::GetCredentials()
   if (authType == NOAUTH)
     return servCred;
   else if (authType == USERPASS && encType == SSL) {
+      if (!users_path.empty() && !proc->LoadUsers(users_path))
+        exit(1);
+      if (!username.empty())
+        proc->AddUser(username, password);
       servCred->SetAuthMetadataProcessor(shared_ptr<UserPassProcessor>(proc));
       return servCred;
   } else if (authType == USERPASS && encType == INSECURE) {
@@ -77,42 +83,3 @@ std::shared_ptr<ServerCredentials> ServerSecurityContext::GetCredentials()
     exit(1);
   }
 }
-
-/* Implement a MetadataProcessor for username/password authentication */
-Status UserPassProcessor::Process(const InputMetadata& auth_metadata,
-                                      grpc::AuthContext* context,
-                                      OutputMetadata* consumed_auth_metadata,
-                                      OutputMetadata* response_metadata)
-{
-  /* Look for username/password fields in Metadata sent by client */
-  auto user_kv = auth_metadata.find("username");
-  if (user_kv == auth_metadata.end()) {
-    std::cerr << "No username field" << std::endl;
-    return grpc::Status(grpc::StatusCode::UNAUTHENTICATED,
-                        "No username field");
-  }
-  auto pass_kv = auth_metadata.find("password");
-  if (pass_kv == auth_metadata.end()) {
-    std::cerr << "No password field" << std::endl;
-    return grpc::Status(grpc::StatusCode::UNAUTHENTICATED,
-                        "No password field");
-  }
-
-  /* test if username and password are good */
-  if (password != pass_kv->second.data() ||
-      username != user_kv->second.data()) {
-    std::cerr << "Invalid username/password" << std::endl;
-    return grpc::Status(grpc::StatusCode::UNAUTHENTICATED,
-                        "Invalid username/password");
-  }
-
-  /* Remove username and password key-value from metadata */
-  consumed_auth_metadata->insert(std::make_pair(
-        string(user_kv->first.data(), user_kv->first.length()),
-        string(user_kv->second.data(), user_kv->second.length())));
-  consumed_auth_metadata->insert(std::make_pair(
-        string(pass_kv->first.data(), pass_kv->first.length()),
-        string(pass_kv->second.data(), pass_kv->second.length())));
-
-  return grpc::Status::OK;
-}
@@ -3,23 +3,14 @@
 
 #include <grpcpp/security/server_credentials.h>
 #include <grpcpp/security/auth_metadata_processor.h>
+#include <grpcpp/security/tls_certificate_provider.h>
+#include <grpcpp/security/tls_credentials_options.h>
 
-using grpc::ServerCredentials;
-using grpc::SslServerCredentialsOptions;
-using grpc::Status;
-
-class UserPassProcessor final : public grpc::AuthMetadataProcessor {
-  public:
-    Status Process(const InputMetadata& auth_metadata,
-                   grpc::AuthContext* context,
-                   OutputMetadata* consumed_auth_metadata,
-                   OutputMetadata* response_metadata) override;
+#include "gnmi_auth.h"
 
-  private:
-    std::string username, password;
-
-  friend class ServerSecurityContext;
-};
+using grpc::ServerCredentials;
+using grpc::experimental::FileWatcherCertificateProvider;
+using grpc::experimental::TlsServerCredentialsOptions;
 
 /* Supported Authentication methods */
 enum AuthType {
@@ -41,13 +32,15 @@ enum EncryptType {
 class ServerSecurityContext {
   private:
     enum EncryptType encType;
-    std::string private_key_path, chain_certs_path; //SSL
+    std::string private_key_path, chain_certs_path, client_ca_path; //SSL
+    std::string username, password, users_path; //USERPASS
+    unsigned int cert_refresh;
 
     enum AuthType authType;
     UserPassProcessor *proc;
 
   public:
-    ServerSecurityContext() : encType(SSL), authType(NOAUTH)
+    ServerSecurityContext() : encType(SSL), cert_refresh(60), authType(NOAUTH)
       {proc = new UserPassProcessor();};
     ~ServerSecurityContext() {delete proc;};
 
@@ -58,11 +51,16 @@ class ServerSecurityContext {
     std::string GetCertsPath() {return chain_certs_path;};
     void SetKeyPath(std::string keyPath) {private_key_path = keyPath;};
     void SetCertsPath(std::string certsPath) {chain_certs_path = certsPath;};
-    /* Authentication Processor to parse message metadata */
-    void SetUsername(std::string user) {proc->username = user;};
-    void SetPassword(std::string pass) {proc->password = pass;};
-    std::string GetUsername() {return proc->username;};
-    std::string GetPassword() {return proc->password;};
+    void SetClientCaPath(std::string caPath) {client_ca_path = caPath;};
+    /* Set seconds between checks of PEM files for a new key or certs */
+    void SetCertRefresh(unsigned int seconds) {cert_refresh = seconds;};
+    /* Users accepted by the Authentication Processor */
+    void SetUsername(std::string user) {username = user;};
+    void SetPassword(std::string pass) {password = pass;};
+    void SetUsersPath(std::string usersPath) {users_path = usersPath;};
+    std::string GetUsername() {return username;};
+    std::string GetPassword() {return password;};
+    std::string GetUsersPath() {return users_path;};
     /* Set/Get Encryption Type of this security context */
     void SetEncryptType(enum EncryptType type) {encType = type;};
     enum EncryptType GetEncryptType() {return encType;};
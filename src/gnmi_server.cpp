@@ -14,6 +14,8 @@
 #include "../proto/gnmi.grpc.pb.h"
 #include "gnmi_security.h"
 #include "gnmi_handle_request.h"
+#include "gnmi_synthetic.h"
+#include "gnmi_pool.h"
 
 using namespace grpc;
 using namespace gnmi;
@@ -21,22 +23,36 @@ using namespace std;
 using namespace chrono;
 using google::protobuf::RepeatedPtrField;
 
-class GNMIServer final : public gNMI::Service
+class GNMIServer final : public AsyncSubscribeService
 {
   public:
+    GNMIServer(SamplingEngine& engine) : engine(engine) {}
 
+    /* Capabilities - Counters follow the layout of VPP stat segment, there
+     * is no YANG model behind them. Ref: 3.2 */
     Status Capabilities(ServerContext* context,
         const CapabilityRequest* request, CapabilityResponse* response)
     {
-      return Status(StatusCode::UNIMPLEMENTED,
-          grpc::string("'Capabilities' method not implemented yet"));
+      ModelData *model = response->add_supported_models();
+      model->set_name("vpp-stats");
+      model->set_organization("FD.io");
+      model = response->add_supported_models();
+      model->set_name("gnmi-server");
+      model->set_organization("FD.io");
+
+      response->add_supported_encodings(JSON);
+      response->add_supported_encodings(JSON_IETF);
+      response->add_supported_encodings(PROTO);
+      response->set_gnmi_version(Notification::descriptor()->file()->
+          options().GetExtension(gnmi_service));
+
+      return Status::OK;
     }
 
     Status Get(ServerContext* context,
         const GetRequest* request, GetResponse* response)
     {
-      return Status(StatusCode::UNIMPLEMENTED,
-          grpc::string("'Get' method not implemented yet"));
+      return GetHandler::Handle(engine, *request, response);
     }
 
     Status Set(ServerContext* context,
@@ -46,29 +62,45 @@ class GNMIServer final : public gNMI::Service
           grpc::string("'Set' method not implemented yet"));
     }
 
-    Status Subscribe(ServerContext* context,
-        ServerReaderWriter<SubscribeResponse, SubscribeRequest>* stream)
-    {
-      return reqH.handleSubscribeRequest(context, stream);
-    }
-
   private:
-    RequestHandler reqH;
+    SamplingEngine& engine;
 };
 
-void RunServer(ServerSecurityContext *cxt)
+/* RunServer - Subscribe RPCs are served asynchronously by one thread per
+ * completion queue, other RPCs by gRPC synchronous thread pool.
+ * Counters are read from VPP, in place in its stat segment if zeroCopy, or
+ * generated when synthetic is not NULL.
+ * Metrics of the server itself are served under TELEMETRY_ROOT. */
+void RunServer(ServerSecurityContext *cxt, unsigned int nbCq,
+               SyntheticConfig *synthetic, bool zeroCopy)
 {
   std::string server_address("0.0.0.0:50051");
-  GNMIServer service;
+  std::unique_ptr<CounterSource> source;
+  if (synthetic)
+    source.reset(new SyntheticCounterSource(*synthetic));
+  else
+    source.reset(new VppCounterSource(zeroCopy));
+  TelemetrySource telemetry; // server own metrics under TELEMETRY_ROOT
+  StatConnector statc(*source, &telemetry);
+  SamplingEngine engine(statc);
+  GNMIServer service(engine);
   ServerBuilder builder;
-  VapiConnector vapic;
+  std::vector<std::unique_ptr<ServerCompletionQueue>> cqs;
+  std::vector<std::thread> handlers;
 
-  std::thread collector (&VapiConnector::RegisterIfaceEvent, &vapic);
+  std::thread collector (&CounterSource::WatchInterfaces, source.get());
+  std::thread sampler (&SamplingEngine::Run, &engine);
 
   builder.AddListeningPort(server_address, cxt->GetCredentials());
   builder.RegisterService(&service);
+  for (unsigned int i = 0; i < nbCq; i++)
+    cqs.push_back(builder.AddCompletionQueue());
   std::unique_ptr<Server> server(builder.BuildAndStart());
-  std::cout << "Server listening on " << server_address << std::endl;
+  std::cout << "Server listening on " << server_address << " with " << nbCq
+    << " completion queue(s)" << std::endl;
+
+  for (auto& cq : cqs)
+    handlers.emplace_back(HandleRpcs, &service, cq.get(), std::ref(engine));
 
   server->Wait();
 }
@@ -80,9 +112,38 @@ static void show_usage(std::string name)
     << "\t-h,--help\t\t\tShow this help message\n"
     << "\t-u,--username USERNAME\t\tDefine connection username\n"
     << "\t-p,--password PASSWORD\t\tDefine connection password\n"
+    << "\t-A,--users USERS\t\tpath to a file of users with salted "
+    << "password hashes\n"
     << "\t-f,--force-insecure\t\tNo TLS connection, no password authentication\n"
     << "\t-k,--private-key PRIVATE_KEY\tpath to server PEM private key\n"
     << "\t-c,--cert-chain CERT_CHAIN\tpath to server PEM certificate chain\n"
+    << "\t-C,--client-ca CA_CERTS\tpath to PEM root certificates "
+    << "verifying client certificates\n"
+    << "\t-r,--cert-refresh SEC\t\tCheck key and certificate chain files "
+    << "for changes every SEC s (default: 60)\n"
+    << "\t-q,--completion-queues NB\tnumber of Subscribe event loops "
+    << "(default: one per core)\n"
+    << "\t-a,--aggregate-threads\t\tSum per thread counters by default, "
+    << "paths with key threads=all keep them per thread\n"
+    << "\t-s,--synthetic SPEC\t\tServe generated counters instead of VPP "
+    << "ones,\n\t\t\t\t\tSPEC is a list of interfaces=N,workers=N,"
+    << "combined=N,simple=N,errors=N,churn=RATIO\n"
+    << "\t-Q,--queue-size NB\t\tBatches of updates waiting to be written on a "
+    << "stream before it is deemed slow (default: 64)\n"
+    << "\t-g,--get-freshness MS\t\tServe Get from counters read up to MS "
+    << "ms before (default: 0, always read)\n"
+    << "\t-P,--slow-consumer POLICY\tcoalesce, drop-oldest or disconnect "
+    << "slow streams (default: coalesce)\n"
+    << "\t-z,--zero-copy\t\t\tRead counters in place in VPP stat segment "
+    << "instead of dumping copies\n"
+    << "\t-w,--poll-window MS\t\tAnswer Polls arriving within MS ms from "
+    << "the same reads (default: 0, polls pending at once)\n"
+    << "\t-U,--max-updates NB\t\tUpdates per Notification, larger ones are "
+    << "split (default: 0, no limit)\n"
+    << "\t-B,--max-bytes NB\t\tBytes of Updates per Notification, larger "
+    << "ones are split (default: 1048576, 0 for no limit)\n"
+    << "\t-j,--collector-threads NB\tThreads building Updates of large "
+    << "reads (default: 1)\n"
     << std::endl;
 }
 
@@ -91,6 +152,15 @@ int main (int argc, char* argv[]) {
   extern char *optarg;
   int option_index = 0;
   std::string username, password;
+  unsigned int nbCq = std::max(1u, std::thread::hardware_concurrency());
+  SyntheticConfig synthetic;
+  bool useSynthetic = false;
+  bool zeroCopy = false;
+  size_t queueSize = 64;
+  size_t maxUpdates = Sample::maxUpdates;
+  size_t maxBytes = Sample::maxBytes;
+  unsigned int collectorThreads = 1;
+  RequestHandler::SlowConsumerPolicy policy = RequestHandler::COALESCE;
   ServerSecurityContext *cxt = new ServerSecurityContext();
 
   static struct option long_options[] =
@@ -98,9 +168,23 @@ int main (int argc, char* argv[]) {
     {"help", no_argument, 0, 'h'},
     {"username", required_argument, 0, 'u'},
     {"password", required_argument, 0, 'p'},
+    {"users", required_argument, 0, 'A'},
     {"private-key", required_argument, 0, 'k'}, //private key
     {"cert-chain", required_argument, 0, 'c'}, //certificate chain
+    {"client-ca", required_argument, 0, 'C'},
+    {"cert-refresh", required_argument, 0, 'r'},
     {"force-insecure", no_argument, 0, 'f'}, //insecure mode
+    {"completion-queues", required_argument, 0, 'q'},
+    {"aggregate-threads", no_argument, 0, 'a'},
+    {"synthetic", required_argument, 0, 's'},
+    {"queue-size", required_argument, 0, 'Q'},
+    {"slow-consumer", required_argument, 0, 'P'},
+    {"get-freshness", required_argument, 0, 'g'},
+    {"zero-copy", no_argument, 0, 'z'},
+    {"poll-window", required_argument, 0, 'w'},
+    {"max-updates", required_argument, 0, 'U'},
+    {"max-bytes", required_argument, 0, 'B'},
+    {"collector-threads", required_argument, 0, 'j'},
     {0, 0, 0, 0}
   };
 
@@ -109,7 +193,7 @@ int main (int argc, char* argv[]) {
    * An option character is followed by (‘::’) indicates an optional argument.
    * Here: optional argument (h,f) ; mandatory arguments (p,u)
    */
-  while ((c = getopt_long(argc, argv, "hfp:u:c:k:", long_options, &option_index))
+  while ((c = getopt_long(argc, argv, "hfazp:u:A:c:k:C:r:q:s:Q:P:g:w:U:B:j:", long_options, &option_index))
          != -1) {
     switch (c)
     {
@@ -137,6 +221,16 @@ int main (int argc, char* argv[]) {
           exit(1);
         }
         break;
+      case 'A':
+        if (optarg) {
+          cxt->SetAuthType(USERPASS);
+          cxt->SetUsersPath(string(optarg));
+        } else {
+          std::cerr << "Please specify a string with users file path\n"
+            << "Ex: --users USERS_PATH" << std::endl;
+          exit(1);
+        }
+        break;
       case 'k':
         if (optarg) {
           cxt->SetKeyPath(string(optarg));
@@ -155,9 +249,119 @@ int main (int argc, char* argv[]) {
           exit(1);
         }
         break;
+      case 'C':
+        if (optarg) {
+          cxt->SetClientCaPath(string(optarg));
+        } else {
+          std::cerr << "Please specify a string with client CA certs path\n"
+            << "Ex: --client-ca CA_PATH" << std::endl;
+          exit(1);
+        }
+        break;
+      case 'r':
+        if (optarg && atoi(optarg) > 0) {
+          cxt->SetCertRefresh(atoi(optarg));
+        } else {
+          std::cerr << "Please specify a positive number of seconds\n"
+            << "Ex: --cert-refresh 60" << std::endl;
+          exit(1);
+        }
+        break;
       case 'f':
         cxt->SetEncryptType(INSECURE);
         break;
+      case 'a':
+        RequestHandler::SetAggregateThreads(true);
+        break;
+      case 's':
+        if (optarg && synthetic.Parse(string(optarg))) {
+          useSynthetic = true;
+        } else {
+          std::cerr << "Please specify synthetic counters as key=value pairs\n"
+            << "Ex: --synthetic interfaces=1000,workers=4,churn=0.1"
+            << std::endl;
+          exit(1);
+        }
+        break;
+      case 'q':
+        if (optarg && atoi(optarg) > 0) {
+          nbCq = atoi(optarg);
+        } else {
+          std::cerr << "Please specify a positive number of completion queues\n"
+            << "Ex: --completion-queues 4" << std::endl;
+          exit(1);
+        }
+        break;
+      case 'Q':
+        if (optarg && atoi(optarg) > 0) {
+          queueSize = atoi(optarg);
+        } else {
+          std::cerr << "Please specify a positive queue size\n"
+            << "Ex: --queue-size 16" << std::endl;
+          exit(1);
+        }
+        break;
+      case 'P':
+        if (optarg && string(optarg) == "coalesce") {
+          policy = RequestHandler::COALESCE;
+        } else if (optarg && string(optarg) == "drop-oldest") {
+          policy = RequestHandler::DROP_OLDEST;
+        } else if (optarg && string(optarg) == "disconnect") {
+          policy = RequestHandler::DISCONNECT;
+        } else {
+          std::cerr << "Please specify coalesce, drop-oldest or disconnect\n"
+            << "Ex: --slow-consumer drop-oldest" << std::endl;
+          exit(1);
+        }
+        break;
+      case 'g':
+        if (optarg && atoi(optarg) >= 0) {
+          GetHandler::SetFreshness(atoll(optarg) * 1000000ULL);
+        } else {
+          std::cerr << "Please specify a freshness window in ms\n"
+            << "Ex: --get-freshness 100" << std::endl;
+          exit(1);
+        }
+        break;
+      case 'z':
+        zeroCopy = true;
+        break;
+      case 'w':
+        if (optarg && atoi(optarg) >= 0) {
+          SamplingEngine::SetPollWindow(atoll(optarg) * 1000000ULL);
+        } else {
+          std::cerr << "Please specify a poll window in ms\n"
+            << "Ex: --poll-window 10" << std::endl;
+          exit(1);
+        }
+        break;
+      case 'U':
+        if (optarg && atoi(optarg) >= 0) {
+          maxUpdates = atoi(optarg);
+        } else {
+          std::cerr << "Please specify a number of updates\n"
+            << "Ex: --max-updates 1000" << std::endl;
+          exit(1);
+        }
+        break;
+      case 'B':
+        if (optarg && atoi(optarg) >= 0) {
+          maxBytes = atoi(optarg);
+        } else {
+          std::cerr << "Please specify a number of bytes\n"
+            << "Ex: --max-bytes 65536" << std::endl;
+          exit(1);
+        }
+        break;
+      case 'j':
+        if (optarg && atoi(optarg) > 0) {
+          collectorThreads = atoi(optarg);
+        } else {
+          std::cerr << "Please specify a positive number of threads\n"
+            << "Ex: --collector-threads 8" << std::endl;
+          exit(1);
+        }
+        break;
       case '?':
         show_usage(argv[0]);
         exit(1);
@@ -175,14 +379,18 @@ int main (int argc, char* argv[]) {
   }
 
   if (cxt->GetAuthType() == AuthType::USERPASS) {
-    if (cxt->GetUsername().empty() || cxt->GetPassword().empty()) {
+    if (cxt->GetUsername().empty() != cxt->GetPassword().empty()) {
       std::cerr << "Both username and password required" << std::endl;
       exit(1);
     }
   }
 
+  RequestHandler::SetFlowControl(queueSize, policy);
+  Sample::SetChunkLimits(maxUpdates, maxBytes);
+  // The thread asking for a read works too
+  WorkPool::Start(collectorThreads - 1);
 
-  RunServer(cxt);
+  RunServer(cxt, nbCq, useSynthetic ? &synthetic : NULL, zeroCopy);
 
   return 0;
 }
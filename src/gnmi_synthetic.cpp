@@ -0,0 +1,166 @@
+/*  vim:set softtabstop=2 shiftwidth=2 tabstop=2 expandtab: */
+
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <cstdlib>
+
+#include "gnmi_synthetic.h"
+
+using namespace std;
+
+/* Parse - Read parameters from a list of key=value pairs.
+ * @param spec comma separated pairs, unknown keys are rejected.
+ * @return false if spec can not be parsed.
+ */
+bool SyntheticConfig::Parse(const string& spec)
+{
+  size_t start = 0;
+
+  while (start < spec.size()) {
+    size_t end = spec.find(',', start);
+    if (end == string::npos)
+      end = spec.size();
+    string pair = spec.substr(start, end - start);
+    start = end + 1;
+    if (pair.empty())
+      continue;
+
+    size_t eq = pair.find('=');
+    if (eq == string::npos)
+      return false;
+    string key = pair.substr(0, eq);
+    const char *value = pair.c_str() + eq + 1;
+    char *last;
+
+    if (key == "churn") {
+      churn = strtod(value, &last);
+      if (*last || churn < 0)
+        return false;
+      continue;
+    }
+
+    unsigned long n = strtoul(value, &last, 10);
+    if (*last || !*value)
+      return false;
+    if (key == "interfaces")
+      interfaces = n;
+    else if (key == "workers")
+      workers = n;
+    else if (key == "combined")
+      combined = n;
+    else if (key == "simple")
+      simple = n;
+    else if (key == "errors")
+      errors = n;
+    else
+      return false;
+  }
+
+  return true;
+}
+
+/* Build the directory described by config, every counter starting at 0, and
+ * publish interface names */
+SyntheticCounterSource::SyntheticCounterSource(const SyntheticConfig& config)
+  : config(config)
+{
+  for (unsigned i = 0; i < config.combined; i++) {
+    Entry e;
+    e.name = i == 0 ? "/if/rx" : i == 1 ? "/if/tx"
+                                        : "/if/combined" + to_string(i);
+    e.type = CounterEntry::COMBINED;
+    e.threads.assign(config.workers, vector<uint64_t>(2 * config.interfaces));
+    directory.push_back(e);
+  }
+  for (unsigned i = 0; i < config.simple; i++) {
+    Entry e;
+    e.name = i == 0 ? "/if/drops" : "/if/simple" + to_string(i);
+    e.type = CounterEntry::SIMPLE;
+    e.threads.assign(config.workers, vector<uint64_t>(config.interfaces));
+    directory.push_back(e);
+  }
+  for (unsigned i = 0; i < config.errors; i++) {
+    Entry e;
+    e.name = "/err/synthetic/error" + to_string(i);
+    e.type = CounterEntry::SCALAR;
+    directory.push_back(e);
+  }
+  for (auto& e : directory) {
+    e.value = 0;
+    e.credit = 0;
+    e.cursor = 0;
+  }
+
+  // Interface names are known right away and never change
+  shared_ptr<IfTable> table = make_shared<IfTable>();
+  for (unsigned i = 0; i < config.interfaces; i++)
+    table->push_back("synth" + to_string(i));
+  PublishIfTable(table);
+}
+
+/* Advance - Increment the share of counters of entry given by churn */
+void SyntheticCounterSource::Advance(Entry& entry)
+{
+  if (entry.type == CounterEntry::SCALAR) {
+    entry.credit += config.churn;
+    entry.value += (uint64_t)entry.credit;
+    entry.credit -= (uint64_t)entry.credit;
+    return;
+  }
+
+  size_t width = entry.type == CounterEntry::COMBINED ? 2 : 1;
+  entry.credit += config.churn * config.interfaces;
+  size_t n = min((size_t)entry.credit, (size_t)config.interfaces);
+  entry.credit -= (size_t)entry.credit;
+
+  for (size_t i = 0; i < n; i++) {
+    size_t j = (entry.cursor + i) % config.interfaces;
+    for (size_t k = 0; k < entry.threads.size(); k++) {
+      entry.threads[k][width * j] += k + 1;
+      if (width == 2) // bytes of 64 bytes packets
+        entry.threads[k][width * j + 1] += 64 * (k + 1);
+    }
+  }
+  if (config.interfaces)
+    entry.cursor = (entry.cursor + n) % config.interfaces;
+}
+
+/* Read - Advance then report counters whose name matches any pattern.
+ * @param patterns regexes on counter names, resolved once.
+ * @param entries where entries pointing to the directory are appended.
+ * @return false if no counter matches.
+ */
+bool SyntheticCounterSource::Read(const vector<string>& patterns,
+                                  vector<CounterEntry>& entries)
+{
+  const vector<u32>& indexes = indexCache.Lookup(patterns, directory.size(),
+      [this](u32 i) -> const string& {return directory[i].name;});
+  if (indexes.empty())
+    return false;
+
+  for (auto i : indexes) {
+    Entry& entry = directory[i];
+    Advance(entry);
+
+    CounterEntry e;
+    e.type = entry.type;
+    e.index = i;
+    e.name = entry.name.c_str();
+    e.value = entry.value;
+    for (auto& values : entry.threads) {
+      e.threads.push_back(values.data());
+      e.lengths.push_back(config.interfaces);
+    }
+    entries.push_back(move(e));
+  }
+
+  return true;
+}
+
+/* WatchInterfaces - Nothing to watch, interface names never change */
+void SyntheticCounterSource::WatchInterfaces()
+{
+  while (1)
+    this_thread::sleep_for(chrono::hours(1));
+}
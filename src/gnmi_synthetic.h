@@ -0,0 +1,60 @@
+/*  vim:set softtabstop=2 shiftwidth=2 tabstop=2 expandtab: */
+
+#ifndef GNMI_SYNTHETIC_H
+#define GNMI_SYNTHETIC_H
+
+#include <string>
+#include <vector>
+
+#include "gnmi_collector.h"
+
+/* Shape of the stats directory generated by SyntheticCounterSource */
+struct SyntheticConfig {
+  unsigned interfaces = 100;
+  unsigned workers = 2;
+  unsigned combined = 2; // per interface packets/bytes counters
+  unsigned simple = 1;   // per interface counters
+  unsigned errors = 10;  // error counters
+  double churn = 1.0;    // share of counters incremented on each read
+
+  /* Parse comma separated key=value pairs, e.g. interfaces=1000,churn=0.1 */
+  bool Parse(const std::string& spec);
+};
+
+/*
+ * CounterSource generating a stats directory in memory, to run the server
+ * without VPP, e.g. for load tests.
+ * Per interface counters are named like VPP ones, /if/rx, /if/tx, then
+ * /if/combined<N> for combined counters and /if/drops then /if/simple<N> for
+ * simple ones. Error counters are /err/synthetic/error<N>.
+ * On each Read, matching counters are incremented: churn * interfaces
+ * interfaces per vector entry, in a round robin manner, and error counters
+ * churn times per read on average.
+ */
+class SyntheticCounterSource : public CounterSource {
+  public:
+    SyntheticCounterSource(const SyntheticConfig& config);
+
+    bool Read(const std::vector<std::string>& patterns,
+              std::vector<CounterEntry>& entries) override;
+    uint64_t Epoch() override {return 1;}; // directory never changes
+    void WatchInterfaces() override;
+
+  private:
+    struct Entry {
+      std::string name;
+      CounterEntry::Type type;
+      std::vector<std::vector<uint64_t>> threads; // values per thread
+      uint64_t value;
+      double credit; // counters to increment not done yet
+      size_t cursor; // next interface to increment
+    };
+
+    void Advance(Entry& entry);
+
+    SyntheticConfig config;
+    std::vector<Entry> directory;
+    NameIndexCache indexCache;
+};
+
+#endif // GNMI_SYNTHETIC_H
@@ -0,0 +1,197 @@
+/*  vim:set softtabstop=2 shiftwidth=2 tabstop=2 expandtab: */
+
+#include <iostream>
+
+#include "gnmi_telemetry.h"
+
+using namespace std;
+using namespace chrono;
+
+mutex Telemetry::shardsMtx;
+vector<unique_ptr<Telemetry::Shard>> Telemetry::shards;
+
+/* LocalShard - Get the shard of calling thread, registered on first use */
+Telemetry::Shard& Telemetry::LocalShard()
+{
+  static thread_local Shard *shard = NULL;
+
+  if (!shard) {
+    unique_ptr<Shard> s(new Shard());
+    for (auto& c : s->counters)
+      c = 0;
+    for (auto& h : s->buckets)
+      for (auto& b : h)
+        b = 0;
+    for (int h = 0; h < HISTOGRAM_MAX; h++)
+      s->sums[h] = s->maxs[h] = 0;
+
+    lock_guard<mutex> lock(shardsMtx);
+    shard = s.get();
+    shards.push_back(move(s));
+  }
+
+  return *shard;
+}
+
+/* Add - Add n to counter, n may be negative for gauges */
+void Telemetry::Add(Counter counter, int64_t n)
+{
+  LocalShard().counters[counter].fetch_add(n, memory_order_relaxed);
+}
+
+/* Observe - Account value in histogram */
+void Telemetry::Observe(Histogram histogram, uint64_t value)
+{
+  Shard& shard = LocalShard();
+  int bucket = value ? 64 - __builtin_clzll(value) - 1 : 0;
+
+  shard.buckets[histogram][bucket].fetch_add(1, memory_order_relaxed);
+  shard.sums[histogram].fetch_add(value, memory_order_relaxed);
+  // Only this thread writes its shard
+  if (value > shard.maxs[histogram].load(memory_order_relaxed))
+    shard.maxs[histogram].store(value, memory_order_relaxed);
+}
+
+Telemetry::Timer::~Timer()
+{
+  Observe(histogram, duration_cast<nanoseconds>(
+        steady_clock::now() - start).count());
+}
+
+/* Read - Sum shards of every thread.
+ * @param counters value of each Counter.
+ * @param buckets number of values of each bucket of each Histogram.
+ * @param sums sum of values of each Histogram.
+ * @param maxs highest value of each Histogram.
+ */
+void Telemetry::Read(vector<uint64_t>& counters,
+                     vector<vector<uint64_t>>& buckets,
+                     vector<uint64_t>& sums, vector<uint64_t>& maxs)
+{
+  counters.assign(COUNTER_MAX, 0);
+  buckets.assign(HISTOGRAM_MAX, vector<uint64_t>(BUCKETS, 0));
+  sums.assign(HISTOGRAM_MAX, 0);
+  maxs.assign(HISTOGRAM_MAX, 0);
+
+  lock_guard<mutex> lock(shardsMtx);
+  for (auto& shard : shards) {
+    for (int c = 0; c < COUNTER_MAX; c++)
+      counters[c] += shard->counters[c].load(memory_order_relaxed);
+    for (int h = 0; h < HISTOGRAM_MAX; h++) {
+      for (int b = 0; b < BUCKETS; b++)
+        buckets[h][b] += shard->buckets[h][b].load(memory_order_relaxed);
+      sums[h] += shard->sums[h].load(memory_order_relaxed);
+      maxs[h] = max(maxs[h], shard->maxs[h].load(memory_order_relaxed));
+    }
+  }
+}
+
+/* Leaf names of counters, then of histograms, in enum order */
+static const char *counterNames[Telemetry::COUNTER_MAX] = {
+  TELEMETRY_ROOT "/collector/index-cache/hits",
+  TELEMETRY_ROOT "/collector/index-cache/misses",
+  TELEMETRY_ROOT "/notifications/sent",
+  TELEMETRY_ROOT "/notifications/bytes",
+  TELEMETRY_ROOT "/samples/dropped",
+  TELEMETRY_ROOT "/samples/coalesced",
+  TELEMETRY_ROOT "/streams/active/stream",
+  TELEMETRY_ROOT "/streams/active/once",
+  TELEMETRY_ROOT "/streams/active/poll",
+  TELEMETRY_ROOT "/streams/disconnected",
+  TELEMETRY_ROOT "/collector/segment-retries",
+  TELEMETRY_ROOT "/polls/shared",
+};
+
+static const char *histogramNames[Telemetry::HISTOGRAM_MAX] = {
+  TELEMETRY_ROOT "/collector/stat-dump-ns",
+  TELEMETRY_ROOT "/notifications/build-ns",
+  TELEMETRY_ROOT "/streams/write-ns",
+  TELEMETRY_ROOT "/streams/queue-depth",
+};
+
+/* Leaves of each histogram, in order */
+enum HistogramLeaf {COUNT, SUM, P50, P99, MAX, HISTOGRAM_LEAVES};
+static const char *histogramLeaves[HISTOGRAM_LEAVES] =
+  {"/count", "/sum", "/p50", "/p99", "/max"};
+
+/* Indexes of telemetry leaves do not collide with stat segment ones */
+static const u32 TELEMETRY_INDEX_BASE = 0xff0000;
+
+TelemetrySource::TelemetrySource()
+{
+  for (int c = 0; c < Telemetry::COUNTER_MAX; c++)
+    names.push_back(counterNames[c]);
+  for (int h = 0; h < Telemetry::HISTOGRAM_MAX; h++)
+    for (int l = 0; l < HISTOGRAM_LEAVES; l++)
+      names.push_back(string(histogramNames[h]) + histogramLeaves[l]);
+}
+
+/* Percentile - Upper bound of the bucket holding quantile q */
+static uint64_t Percentile(const vector<uint64_t>& buckets, double q)
+{
+  uint64_t total = 0, seen = 0;
+
+  for (auto n : buckets)
+    total += n;
+  if (total == 0)
+    return 0;
+
+  for (int b = 0; b < Telemetry::BUCKETS; b++) {
+    seen += buckets[b];
+    if (seen >= q * total)
+      return b == 63 ? UINT64_MAX : (2ULL << b) - 1;
+  }
+
+  return UINT64_MAX;
+}
+
+/* Read - Report telemetry leaves whose name matches any pattern.
+ * @param patterns regexes on leaf names, resolved once.
+ * @param entries where SCALAR entries are appended.
+ * @return false if no leaf matches.
+ */
+bool TelemetrySource::Read(const vector<string>& patterns,
+                           vector<CounterEntry>& entries)
+{
+  const vector<u32>& indexes = indexCache.Lookup(patterns, names.size(),
+      [this](u32 i) -> const string& {return names[i];});
+  if (indexes.empty())
+    return false;
+
+  vector<uint64_t> counters, sums, maxs;
+  vector<vector<uint64_t>> buckets;
+  Telemetry::Read(counters, buckets, sums, maxs);
+
+  for (auto i : indexes) {
+    CounterEntry e;
+    e.type = CounterEntry::SCALAR;
+    e.index = TELEMETRY_INDEX_BASE + i;
+    e.name = names[i].c_str();
+    if (i < Telemetry::COUNTER_MAX) {
+      e.value = counters[i];
+    } else {
+      int h = (i - Telemetry::COUNTER_MAX) / HISTOGRAM_LEAVES;
+      switch ((i - Telemetry::COUNTER_MAX) % HISTOGRAM_LEAVES) {
+        case COUNT:
+          e.value = 0;
+          for (auto n : buckets[h])
+            e.value += n;
+          break;
+        case SUM:
+          e.value = sums[h];
+          break;
+        case P50:
+          e.value = min(Percentile(buckets[h], 0.5), maxs[h]);
+          break;
+        case P99:
+          e.value = min(Percentile(buckets[h], 0.99), maxs[h]);
+          break;
+        default:
+          e.value = maxs[h];
+      }
+    }
+    entries.push_back(move(e));
+  }
+
+  return true;
+}
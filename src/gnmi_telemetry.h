@@ -0,0 +1,107 @@
+/*  vim:set softtabstop=2 shiftwidth=2 tabstop=2 expandtab: */
+
+#ifndef GNMI_TELEMETRY_H
+#define GNMI_TELEMETRY_H
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gnmi_collector.h"
+
+/* Root of the paths of the server own metrics */
+#define TELEMETRY_ROOT "/gnmi-server"
+
+/*
+ * Metrics of the server own pipeline.
+ * Every thread updates its own shard with relaxed atomic operations, shards
+ * are only summed when metrics are read, so instrumentation does not contend
+ * between threads. Histograms have one bucket per power of 2.
+ */
+class Telemetry {
+  public:
+    enum Counter {
+      INDEX_CACHE_HITS,
+      INDEX_CACHE_MISSES,
+      NOTIFICATIONS_SENT,
+      SERIALIZED_BYTES,
+      SAMPLES_DROPPED,
+      SAMPLES_COALESCED,
+      STREAMS_STREAM, // active streams per subscription mode
+      STREAMS_ONCE,
+      STREAMS_POLL,
+      STREAMS_DISCONNECTED, // slow consumers disconnected
+      SEGMENT_RETRIES, // in place reads retried on a concurrent change
+      POLLS_SHARED, // polled paths served by a read shared with other polls
+      COUNTER_MAX
+    };
+
+    enum Histogram {
+      STAT_DUMP_NS,  // reading counters from the source
+      BUILD_NS,      // building and encoding notifications of a batch
+      WRITE_NS,      // gRPC write, from Write call to its completion
+      QUEUE_DEPTH,   // responses queued on a stream when one is added
+      HISTOGRAM_MAX
+    };
+
+    static const int BUCKETS = 64;
+
+    static void Add(Counter counter, int64_t n = 1);
+    static void Observe(Histogram histogram, uint64_t value);
+
+    /* Totals over every thread */
+    static void Read(std::vector<uint64_t>& counters,
+                     std::vector<std::vector<uint64_t>>& buckets,
+                     std::vector<uint64_t>& sums, std::vector<uint64_t>& maxs);
+
+    /* Observe the lifetime of a Timer in ns */
+    class Timer {
+      public:
+        Timer(Histogram histogram) : histogram(histogram),
+          start(std::chrono::steady_clock::now()) {}
+        ~Timer();
+
+      private:
+        Histogram histogram;
+        std::chrono::steady_clock::time_point start;
+    };
+
+  private:
+    struct Shard {
+      std::atomic<uint64_t> counters[COUNTER_MAX];
+      std::atomic<uint64_t> buckets[HISTOGRAM_MAX][BUCKETS];
+      std::atomic<uint64_t> sums[HISTOGRAM_MAX];
+      std::atomic<uint64_t> maxs[HISTOGRAM_MAX];
+    };
+
+    static Shard& LocalShard();
+
+    /* Shards of every thread that has updated a metric. They are kept when
+     * threads exit so that totals never decrease. */
+    static std::mutex shardsMtx;
+    static std::vector<std::unique_ptr<Shard>> shards;
+};
+
+/*
+ * CounterSource exposing Telemetry under TELEMETRY_ROOT. Counters are leaves
+ * of their own, histograms have count, sum, p50, p99 and max leaves.
+ * Percentiles are the upper bound of the bucket they fall in, capped by max.
+ */
+class TelemetrySource : public CounterSource {
+  public:
+    TelemetrySource();
+
+    bool Read(const std::vector<std::string>& patterns,
+              std::vector<CounterEntry>& entries) override;
+    uint64_t Epoch() override {return 1;}; // directory never changes
+    void WatchInterfaces() override {};
+
+  private:
+    std::vector<std::string> names;
+    NameIndexCache indexCache;
+};
+
+#endif // GNMI_TELEMETRY_H
@@ -0,0 +1,104 @@
+/*  vim:set softtabstop=2 shiftwidth=2 tabstop=2 expandtab: */
+
+/*
+ * Check of client defined aliases, run by make check against a server on
+ * synthetic counters. A POLL subscription defines aliases on interface
+ * prefixes, with or without origin and keys, then polls once: prefixes must
+ * be replaced by the alias of matching origin only. Ref: 2.4.2
+ * Usage: gnmi_alias_test [ADDRESS], ADDRESS defaulting to localhost:50051.
+ */
+
+#include <iostream>
+#include <map>
+#include <string>
+
+#include <grpcpp/grpcpp.h>
+
+#include "../proto/gnmi.grpc.pb.h"
+
+using namespace grpc;
+using namespace gnmi;
+using namespace std;
+
+/* AddAlias - Define alias on origin:/if/rx/IFACE, with key on rx if any */
+static void AddAlias(AliasList *list, const string& alias,
+                     const string& origin, const string& iface,
+                     const string& key = "", const string& value = "")
+{
+  Alias *a = list->add_alias();
+  a->set_alias(alias);
+  Path *path = a->mutable_path();
+  path->set_origin(origin);
+  path->add_elem()->set_name("if");
+  PathElem *rx = path->add_elem();
+  rx->set_name("rx");
+  if (!key.empty())
+    (*rx->mutable_key())[key] = value;
+  path->add_elem()->set_name(iface);
+}
+
+int main(int argc, char **argv)
+{
+  string address = argc > 1 ? argv[1] : "localhost:50051";
+  auto stub = gNMI::NewStub(CreateChannel(address,
+                                          InsecureChannelCredentials()));
+  ClientContext context;
+  auto stream = stub->Subscribe(&context);
+
+  SubscribeRequest request;
+  SubscriptionList *list = request.mutable_subscribe();
+  list->set_mode(SubscriptionList_Mode_POLL);
+  list->set_encoding(JSON);
+  list->add_subscription()->mutable_path()->add_elem()->set_name("if");
+  stream->Write(request);
+
+  request.Clear();
+  AliasList *aliases = request.mutable_aliases();
+  AddAlias(aliases, "#origin", "vpp-stats", "synth0");
+  AddAlias(aliases, "#keys", "vpp-stats", "synth1", "name", "synth1");
+  AddAlias(aliases, "#bare", "", "synth2");
+  AddAlias(aliases, "#other", "gnmi-server", "synth3");
+  stream->Write(request);
+
+  request.Clear();
+  request.mutable_poll();
+  stream->Write(request);
+  stream->WritesDone();
+
+  // Updates received by prefix, full prefix or alias
+  map<string, int> prefixes;
+  SubscribeResponse response;
+  while (stream->Read(&response)) {
+    if (!response.has_update())
+      continue;
+    string prefix;
+    for (auto& elem : response.update().prefix().elem())
+      prefix += "/" + elem.name();
+    prefixes[prefix] += response.update().update_size();
+  }
+  Status status = stream->Finish();
+  if (!status.ok()) {
+    cerr << "FAIL: Subscribe ended with " << status.error_message() << endl;
+    return 1;
+  }
+
+  int failures = 0;
+  const string expected[] = {"/#origin", "/#keys", "/#bare", "/if/rx/synth3"};
+  for (auto& prefix : expected) {
+    if (prefixes[prefix] == 0) {
+      cerr << "FAIL: no update under " << prefix << endl;
+      failures++;
+    }
+  }
+  const string unexpected[] = {"/#other", "/if/rx/synth0", "/if/rx/synth1",
+                               "/if/rx/synth2"};
+  for (auto& prefix : unexpected) {
+    if (prefixes[prefix] != 0) {
+      cerr << "FAIL: updates under " << prefix << endl;
+      failures++;
+    }
+  }
+
+  cout << (failures ? "FAIL" : "PASS") << ": client aliases" << endl;
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,201 @@
+/*  vim:set softtabstop=2 shiftwidth=2 tabstop=2 expandtab: */
+
+/*
+ * Stress test of the sampling engine, built with ThreadSanitizer by make
+ * check. Sinks subscribe, poll and unsubscribe from several threads while
+ * the engine samples synthetic counters, their Samples are serialized in
+ * every form as streams do, the interface table is republished with other
+ * names and Get-like Snapshots are taken. ThreadSanitizer reports any race,
+ * the test itself fails if a sink gets Samples once unsubscribed.
+ * Usage: gnmi_stress_test [SYNTHETIC_SPEC] [SECONDS], see gnmi_server
+ *        --synthetic, SECONDS defaulting to 5.
+ */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+
+#include "../src/gnmi_synthetic.h"
+#include "../src/gnmi_telemetry.h"
+#include "../src/gnmi_sampler.h"
+#include "../src/gnmi_pool.h"
+
+using namespace std;
+using namespace chrono;
+
+/* Number of threads subscribing and unsubscribing sinks */
+static const int SUBSCRIBERS = 4;
+/* Sampling interval of SAMPLE subscriptions, short to tick often */
+static const uint64_t INTERVAL = 5000000;
+
+/* Paths subscribed by every sink, overlapping so that Samples are shared */
+static const vector<SampleKey> KEYS = {
+  SampleKey("/if/rx", false), SampleKey("/if/rx", true),
+  SampleKey("/if", false), SampleKey("/err", false),
+  SampleKey("/gnmi-server/notifications", false)
+};
+
+/* StressSink - Sink of a subscriber thread, counting Samples received while
+ * it is not subscribed */
+class StressSink : public SampleSink {
+  public:
+    void Push(vector<SamplePtr> batch) override {Receive(batch);};
+    void Polled(vector<SamplePtr> samples) override {Receive(samples);};
+
+    /* Tell whether the engine may push into this sink */
+    void SetSubscribed(bool value)
+    {
+      lock_guard<mutex> lock(mtx);
+      subscribed = value;
+    }
+
+    /* Take the Samples received so far, waiting up to timeout for some */
+    vector<SamplePtr> Take(milliseconds timeout = milliseconds(0))
+    {
+      unique_lock<mutex> lock(mtx);
+      cv.wait_for(lock, timeout, [this]() {return !received.empty();});
+      vector<SamplePtr> taken;
+      taken.swap(received);
+      return taken;
+    }
+
+    atomic<uint64_t> late{0};
+
+  private:
+    void Receive(vector<SamplePtr>& samples)
+    {
+      lock_guard<mutex> lock(mtx);
+      if (!subscribed)
+        late += samples.size();
+      received.insert(received.end(), samples.begin(), samples.end());
+      cv.notify_one();
+    }
+
+    mutex mtx;
+    condition_variable cv;
+    bool subscribed = false;
+    vector<SamplePtr> received;
+};
+
+/* Serialize - Serialize samples in every form, as streams sharing them do.
+ * @return the number of chunks serialized.
+ */
+static size_t Serialize(const vector<SamplePtr>& samples)
+{
+  size_t chunks = 0;
+
+  for (auto& sample : samples) {
+    for (Encoding encoding : {gnmi::PROTO, gnmi::JSON, gnmi::JSON_IETF}) {
+      for (int bulk = 0; bulk < 2; bulk++) {
+        size_t n = sample->Chunks(encoding, bulk);
+        for (size_t c = 0; c < n; c++)
+          sample->Serialized(c, encoding, bulk);
+        chunks += n;
+      }
+    }
+  }
+
+  return chunks;
+}
+
+/* Subscriber - Subscribe sink in every mode, poll, then unsubscribe, until
+ * deadline. */
+static void Subscriber(SamplingEngine& engine, StressSink& sink,
+                       steady_clock::time_point deadline,
+                       atomic<uint64_t>& chunks)
+{
+  for (int round = 0; steady_clock::now() < deadline; round++) {
+    sink.SetSubscribed(true);
+    for (size_t i = 0; i < KEYS.size(); i++) {
+      SubscriptionMode mode = (round + i) % 2 ? gnmi::ON_CHANGE : gnmi::SAMPLE;
+      engine.Subscribe(KEYS[i], mode, INTERVAL * (1 + i % 3), &sink);
+    }
+    engine.Sync(KEYS, &sink);
+    engine.Poll(KEYS, &sink);
+    chunks += Serialize(sink.Take(seconds(1)));
+    this_thread::sleep_for(milliseconds(round % 10));
+    chunks += Serialize(sink.Take());
+
+    // No Sample may be pushed once Unsubscribe returns
+    engine.Unsubscribe(&sink);
+    sink.SetSubscribed(false);
+    chunks += Serialize(sink.Take());
+  }
+}
+
+/* Renamer - Republish the interface table with other names and sizes until
+ * deadline, as on interface events. */
+static void Renamer(steady_clock::time_point deadline)
+{
+  IfTablePtr original = CounterSource::GetIfTable();
+
+  for (int round = 0; steady_clock::now() < deadline; round++) {
+    shared_ptr<IfTable> table = make_shared<IfTable>(*original);
+    if (round % 2) {
+      for (auto& name : *table)
+        name = "renamed_" + name;
+      table->resize(table->size() + round % 3);
+    }
+    CounterSource::PublishIfTable(table);
+    this_thread::sleep_for(microseconds(500));
+  }
+  CounterSource::PublishIfTable(original);
+}
+
+int main(int argc, char* argv[]) {
+  SyntheticConfig config;
+  config.interfaces = 100;
+  config.workers = 2;
+  if (argc > 1 && !config.Parse(argv[1])) {
+    cerr << "Invalid synthetic spec " << argv[1] << endl;
+    return 1;
+  }
+  int secs = argc > 2 ? atoi(argv[2]) : 5;
+
+  // Several chunks per Sample, read and encoded by more than one thread
+  Sample::SetChunkLimits(16, 1024);
+  WorkPool::Start(2);
+
+  SyntheticCounterSource source(config);
+  TelemetrySource telemetry;
+  StatConnector statc(source, &telemetry);
+  SamplingEngine engine(statc);
+  thread sampler(&SamplingEngine::Run, &engine);
+
+  steady_clock::time_point deadline = steady_clock::now() + seconds(secs);
+  atomic<uint64_t> chunks(0);
+  vector<StressSink> sinks(SUBSCRIBERS);
+  vector<thread> threads;
+  for (auto& sink : sinks)
+    threads.emplace_back(Subscriber, ref(engine), ref(sink), deadline,
+                         ref(chunks));
+  threads.emplace_back(Renamer, deadline);
+
+  // Get requests meanwhile
+  uint64_t snapshots = 0;
+  while (steady_clock::now() < deadline) {
+    engine.Snapshot({"/if/tx", "/err"}, snapshots % 2, INTERVAL);
+    snapshots++;
+    this_thread::sleep_for(microseconds(200));
+  }
+
+  for (auto& t : threads)
+    t.join();
+  engine.Stop();
+  sampler.join();
+
+  uint64_t late = 0;
+  for (auto& sink : sinks)
+    late += sink.late;
+  cout << "chunks " << chunks << ", snapshots " << snapshots << endl;
+  if (late) {
+    cerr << "FAIL: " << late << " Samples received once unsubscribed" << endl;
+    return 1;
+  }
+  cout << "PASS: concurrent sampling" << endl;
+  return 0;
+}